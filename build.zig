@@ -19,6 +19,7 @@ fn makeKernel(b: *std.Build) *std.Build.Step {
     const arch = b.option(std.Target.Cpu.Arch, "arch", "The target CPU architecture");
     const optimize = b.standardOptimizeOption(.{});
     const emitAsm = b.option(bool, "emit-asm", "Generate assembler code file");
+    const bench = b.option(bool, "bench", "Run kernel microbenchmarks after initialization");
 
     const target = b.resolveTargetQuery(.{
         .os_tag = .freestanding,
@@ -46,6 +47,10 @@ fn makeKernel(b: *std.Build) *std.Build.Step {
     kernel_obj.root_module.addImport("dbg-info", dbg_module);
     kernel_obj.addIncludePath(b.path("third-party/boot"));
 
+    const build_options = b.addOptions();
+    build_options.addOption(bool, "bench", bench orelse false);
+    kernel_obj.root_module.addOptions("build-options", build_options);
+
     const dbg_maker = b.addExecutable(.{
         .name = "dbg-maker",
         .root_source_file = b.path(src_path++"/debug-maker/main.zig"),
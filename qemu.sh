@@ -11,9 +11,21 @@ if [ -n "$QEMU_GDB" ]; then
     DBG+="-s -S"
 fi
 
+NUMA=""
+
+# Two memory nodes with two CPUs each, described by ACPI SRAT/SLIT
+if [ -n "$QEMU_NUMA" ]; then
+    NUMA+="-object memory-backend-ram,size=32M,id=mem0 "
+    NUMA+="-object memory-backend-ram,size=32M,id=mem1 "
+    NUMA+="-numa node,nodeid=0,cpus=0-1,memdev=mem0 "
+    NUMA+="-numa node,nodeid=1,cpus=2-3,memdev=mem1 "
+    NUMA+="-numa dist,src=0,dst=1,val=20"
+fi
+
 unset GTK_PATH
 qemu-system-x86_64 \
  ${DBG} \
+ ${NUMA} \
  -chardev stdio,id=char0 \
  -serial chardev:char0 \
  -bios ${UEFI} -nic none -no-reboot \
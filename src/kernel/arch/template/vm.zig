@@ -53,6 +53,35 @@ pub fn freePt(pt: *PageTable) void {
     _ = pt;
 }
 
+/// The function should fill the pages with zeros.
+/// It's used to prepare zeroed pages in the background,
+/// so the implementation should avoid polluting the cache
+/// (e.g. using non-temporal stores) if possible.
+pub fn zeroPages(virt: usize, pages: u32) void {
+    _ = virt;
+    _ = pages;
+}
+
+/// The function should unmap the pages from the page table,
+/// free the page tables left empty (except the ones shared by `clonePt`)
+/// and invalidate the TLB entries of the range on all CPUs.
+/// 
+/// Returns an error if the unmapping requires memory allocation
+/// (e.g. splitting of a large page) and it fails.
+pub fn unmap(virt: usize, pages: u32, page_table: *PageTable) vm.Error!void {
+    _ = virt;
+    _ = pages;
+    _ = page_table;
+}
+
+/// The function should invalidate the TLB entries
+/// of the virtual range on all CPUs.
+/// It's called with interrupts enabled and never from an interrupt handler.
+pub fn flushTlb(virt: usize, pages: u32) void {
+    _ = virt;
+    _ = pages;
+}
+
 /// The function should return the current page table
 /// used by the CPU core on which this function is called.
 /// 
@@ -68,6 +97,13 @@ pub fn setPt(pt: *const PageTable) void {
     _ = pt;
 }
 
+/// The function is called before the top level page table is freed.
+/// If the architecture tags TLB entries with address space identifiers,
+/// the identifiers of the page table must not be reused without a flush.
+pub fn releasePt(pt: *const PageTable) void {
+    _ = pt;
+}
+
 /// The function should efficiently map the kernel
 /// in the destination page table based on the source table.
 /// The mapped sections should be shared across multiple tables simultaneously,
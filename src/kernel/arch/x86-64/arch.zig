@@ -44,7 +44,11 @@ pub const vm = @import("vm.zig");
 
 pub const CpuLocalData = struct {
     self_ptr: usize,
-    apic_id: u8
+    apic_id: u8,
+
+    pcids: vm.PcidCache,
+    /// Set if the CPU must handle the TLB shootdown request, see `vm.flushTlb`.
+    tlb_pending: std.atomic.Value(bool),
 };
 
 pub const cpuid_features = 1;
@@ -111,6 +115,8 @@ pub inline fn setCpuLocalData(local_data: *smp.LocalData) void {
     local_data.arch_specific.apic_id = @truncate(
         cpuid(cpuid_features, undefined, undefined, undefined).b >> 24
     );
+    local_data.arch_specific.pcids = .{};
+    local_data.arch_specific.tlb_pending = std.atomic.Value(bool).init(false);
 
     regs.setGs(0);
     regs.setMsr(regs.MSR_GS_BASE, @intFromPtr(local_data));
@@ -134,6 +140,7 @@ pub inline fn getCpuLocalData() *smp.LocalData {
 /// preinitializing the virtual memory system, the interrupt system, and etc.
 pub inline fn initCpu() void {
     enableExtentions();
+    vm.initCpu();
 }
 
 pub fn setupCpu(cpu_idx: u16) void {
@@ -29,6 +29,23 @@ pub const avail_vectors = max_vectors - reserved_vectors;
 
 pub const irq_base_vec = reserved_vectors;
 
+/// Page fault exception vector.
+const page_fault_vec = 14;
+/// Page fault error code bit, set if the page is present (protection violation).
+const page_fault_present = 0x1;
+
+/// Number of vectors reserved on all CPUs for the inter-processor interrupts.
+pub const ipi_vectors_num = 2;
+/// The last vector is left for the spurious interrupts.
+pub const ipi_vec_base = max_vectors - ipi_vectors_num - 1;
+/// TLB shootdown IPI vector, see `vm.flushTlb`.
+pub const tlb_vec = ipi_vec_base;
+/// Wake up IPI vector, see `waitForCpu`.
+pub const wake_vec = ipi_vec_base + 1;
+
+/// xAPIC can address up to 256 CPUs.
+const max_ipi_cpus = 256;
+
 const rsrvd_vec_num = 32;
 const irq_stack_size = vm.page_size;
 
@@ -77,7 +94,7 @@ pub const TaskStateSegment = extern struct {
 };
 
 const IsrFn = *const fn() callconv(.Naked) noreturn;
-const ExceptionIsrFn = @TypeOf(&commonExcpHandler);
+const ExceptionIsrFn = *const fn(*regs.IntrState, u32, u32) callconv(.C) void;
 
 const IrqStack = [irq_stack_size / @sizeOf(u64)]u64;
 
@@ -87,6 +104,9 @@ var idts: []DescTable = &.{};
 var tss_pool: []TaskStateSegment = &.{};
 var irq_stacks: []IrqStack = &.{};
 
+/// CPUs with the IPI handlers installed.
+var ipi_ready: [max_ipi_cpus]bool = .{false} ** max_ipi_cpus;
+
 pub fn preinit() void {
     const cpus_num = smp.getNum();
     const idts_pages = std.math.divCeil(
@@ -134,8 +154,23 @@ pub fn init() !intr.Chip {
 }
 
 pub inline fn setupCpu(cpu_idx: u8) void {
+    idts[cpu_idx][tlb_vec] = Descriptor.init(@intFromPtr(&tlbIsr), 0, intr_gate_flags);
+    idts[cpu_idx][wake_vec] = Descriptor.init(@intFromPtr(&wakeIsr), 0, intr_gate_flags);
+
     useIdt(&idts[cpu_idx]);
     regs.setTss(gdt.getTssOffset(cpu_idx));
+
+    @atomicStore(bool, &ipi_ready[cpu_idx], true, .release);
+}
+
+/// Checks if the CPU can receive IPIs.
+pub inline fn isIpiReady(cpu_idx: u16) bool {
+    return apic.lapic.isInitialized() and @atomicLoad(bool, &ipi_ready[cpu_idx], .acquire);
+}
+
+/// Sends the inter-processor interrupt to the CPU.
+pub inline fn sendIpi(cpu_idx: u16, vec: u8) void {
+    apic.lapic.sendIpi(apic.cpuIdxToApicId(cpu_idx), vec);
 }
 
 pub fn setupIsr(vec: intr.Vector, isr: IsrFn, stack: enum{kernel,user}, type_attr: u8) void {
@@ -165,6 +200,37 @@ pub inline fn disableForCpu() void {
     asm volatile("cli");
 }
 
+pub inline fn isEnabledForCpu() bool {
+    return (regs.getRflags() & regs.RFLAGS_IF) != 0;
+}
+
+/// Enables interrupts and halts the current CPU until the next interrupt.
+/// `sti` delays the interrupts by one instruction, so an interrupt that became
+/// pending while they were disabled (e.g. the `wake_vec` IPI) ends the halt.
+pub inline fn waitForCpu() void {
+    @setRuntimeSafety(false);
+    asm volatile(
+        \\sti
+        \\hlt
+    );
+}
+
+/// Disables interrupts on the current CPU.
+///
+/// - Returns: `true` if interrupts were enabled, must be passed to `restoreForCpu`.
+pub inline fn saveAndDisableForCpu() bool {
+    const is_enabled = isEnabledForCpu();
+    disableForCpu();
+
+    return is_enabled;
+}
+
+/// Enables interrupts on the current CPU if they were enabled
+/// before the `saveAndDisableForCpu` call.
+pub inline fn restoreForCpu(is_enabled: bool) void {
+    if (is_enabled) enableForCpu();
+}
+
 fn initIdts() !void {
     for (idts[1..idts.len]) |*idt| {
         for (0..rsrvd_vec_num) |vec| {
@@ -212,6 +278,8 @@ fn initExceptHandlers() void {
         );
         except_handlers[vec] = &commonExcpHandler;
     }
+
+    except_handlers[page_fault_vec] = &pageFaultHandler;
 }
 
 export fn excpHandlerCaller() callconv(.Naked) noreturn {
@@ -224,16 +292,22 @@ export fn excpHandlerCaller() callconv(.Naked) noreturn {
         \\mov -0x10(%rsp),%rsi
     );
 
-    if (comptime (@sizeOf(regs.IntrState) % 0x10) == 0) {
-        asm volatile("sub $0x8,%rsp");
-    }
+    // The CPU aligns the frame to 16 bytes, `call` pushes the return address
+    const is_stack_aligned = comptime (@sizeOf(regs.IntrState) % 0x10) == 0;
+    if (comptime !is_stack_aligned) regs.stackAlloc(1);
 
     asm volatile(
         \\mov %[table],%rcx
-        \\jmp *(%rcx,%rsi,8)
+        \\call *(%rcx,%rsi,8)
         :
         : [table] "i" (&except_handlers),
     );
+
+    // The handler returns only if the exception is resolved
+    if (comptime !is_stack_aligned) regs.stackFree(1);
+
+    regs.restoreState();
+    iret();
 }
 
 fn ExcpHandler(vec: comptime_int) type {
@@ -270,7 +344,15 @@ fn ExcpHandler(vec: comptime_int) type {
     };
 }
 
-fn commonExcpHandler(state: *regs.IntrState, vec: u32, error_code: u32) callconv(.C) noreturn {
+/// Resolves faults on the not present pages of lazy regions (see `vm.VirtualRegion`),
+/// the rest of faults are fatal.
+fn pageFaultHandler(state: *regs.IntrState, vec: u32, error_code: u32) callconv(.C) void {
+    if ((error_code & page_fault_present) == 0 and vm.handlePageFault(regs.getCr2())) return;
+
+    commonExcpHandler(state, vec, error_code);
+}
+
+fn commonExcpHandler(state: *regs.IntrState, vec: u32, error_code: u32) callconv(.C) void {
     panic.exception(
         state.intr.rip,
         state.intr.rsp,
@@ -378,9 +460,37 @@ export fn msiHandlerCaller(idx: u8) callconv(.C) void {
     intr.handleMsi(idx);
 }
 
+/// Needed just for switch from naked calling convention to C.
+export fn tlbHandlerCaller(_: u8) callconv(.C) void {
+    arch.vm.handleTlbShootdown();
+    apic.lapic.set(.eoi, 0);
+}
+
+/// Needed just for switch from naked calling convention to C.
+/// The IPI only ends the halt of `waitForCpu`.
+export fn wakeHandlerCaller(_: u8) callconv(.C) void {
+    apic.lapic.set(.eoi, 0);
+}
+
 comptime{
     @export(&CommonIntrHandler("irqHandlerCaller").handler, .{ .name = "commonIrqHandler" });
     @export(&CommonIntrHandler("msiHandlerCaller").handler, .{ .name = "commonMsiHandler" });
+    @export(&CommonIntrHandler("tlbHandlerCaller").handler, .{ .name = "commonTlbHandler" });
+    @export(&CommonIntrHandler("wakeHandlerCaller").handler, .{ .name = "commonWakeHandler" });
+}
+
+fn tlbIsr() callconv(.Naked) noreturn {
+    asm volatile(
+        \\push $0
+        \\jmp commonTlbHandler
+    );
+}
+
+fn wakeIsr() callconv(.Naked) noreturn {
+    asm volatile(
+        \\push $0
+        \\jmp commonWakeHandler
+    );
 }
 
 inline fn iret() void {
@@ -37,6 +37,16 @@ pub const Regs = enum(u16) {
     const icr_base = 0x300;
 };
 
+/// Interrupt Command Register, used to send IPIs.
+const Icr = struct {
+    const low = Regs.icr_base;
+    const high = Regs.icr_base + 0x10;
+
+    const delivery_pending = 0x1000;
+    const level_assert = 0x4000;
+    const dest_shift = 24;
+};
+
 const APIC_ENABLED = 0x800;
 
 var is_initialized = false;
@@ -82,3 +92,13 @@ pub inline fn write(offset: u16, value: u32) void {
 pub inline fn getId() u32 {
     return get(.id) >> 24;
 }
+
+/// Sends a fixed inter-processor interrupt to the CPU with the APIC id.
+/// Waits until the previous IPI is accepted.
+pub fn sendIpi(apic_id: u8, vec: u8) void {
+    while ((read(Icr.low) & Icr.delivery_pending) != 0) std.atomic.spinLoopHint();
+
+    // Writing to the low part sends the IPI
+    write(Icr.high, @as(u32, apic_id) << Icr.dest_shift);
+    write(Icr.low, Icr.level_assert | vec);
+}
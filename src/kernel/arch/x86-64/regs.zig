@@ -17,6 +17,15 @@ pub const MSR_FG_BASE = 0xC0000100;
 pub const MSR_GS_BASE = 0xC0000101;
 pub const MSR_SWAPGS_BASE = 0xC0000102;
 pub const MSR_APIC_BASE = 0x1B;
+pub const MSR_PAT = 0x277;
+
+/// Page Global Enable bit of the CR4.
+pub const CR4_PGE = 0x80;
+/// Process-Context Identifiers Enable bit of the CR4.
+pub const CR4_PCIDE = 0x20000;
+
+/// Interrupt Enable Flag of the RFLAGS.
+pub const RFLAGS_IF = 0x200;
 
 /// Interrupt Descriptor Table Register.
 pub const IDTR = packed struct {
@@ -111,7 +120,7 @@ pub inline fn getMsr(msr_addr: u32) u64 {
         : [msr_addr] "{ecx}" (msr_addr),
     );
 
-    return value_l | (@as(u64, value_h) >> 32);
+    return value_l | (@as(u64, value_h) << 32);
 }
 
 /// Write Model-Specific Register.
@@ -159,6 +168,17 @@ pub inline fn setGdtr(gdtr: GDTR) void {
     );
 }
 
+pub inline fn getRflags() u64 {
+    var result: u64 = undefined;
+    asm volatile (
+        \\pushfq
+        \\pop %[res]
+        : [res] "=r" (result),
+    );
+
+    return result;
+}
+
 pub inline fn getCr2() u64 {
     var result: u64 = undefined;
     asm volatile ("mov %%cr2,%[res]"
@@ -193,6 +213,38 @@ pub inline fn getCr4() u64 {
     return result;
 }
 
+pub inline fn setCr4(cr4: u64) void {
+    asm volatile ("mov %[val],%%cr4"
+        :
+        : [val] "r" (cr4),
+        : "memory"
+    );
+}
+
+/// Invalidates the TLB entries of the page containing the address.
+pub inline fn invlpg(virt: usize) void {
+    asm volatile ("invlpg (%[addr])"
+        :
+        : [addr] "r" (virt),
+        : "memory"
+    );
+}
+
+/// Invalidates the TLB entries tagged with PCIDs.
+/// 
+/// - `kind`: 0 - an address in the PCID, 1 - whole PCID,
+///   2 - all PCIDs including global pages, 3 - all PCIDs except global pages.
+pub inline fn invpcid(kind: u64, pcid: u12, virt: usize) void {
+    const desc = [2]u64{ pcid, virt };
+
+    asm volatile ("invpcid (%[desc]),%[kind]"
+        :
+        : [desc] "r" (&desc),
+          [kind] "r" (kind),
+        : "memory"
+    );
+}
+
 pub inline fn getCs() u16 {
     var cs: u16 = undefined;
     asm volatile ("mov %%cs,%[res]"
@@ -4,9 +4,12 @@
 
 const std = @import("std");
 
+const arch = @import("arch.zig");
 const boot = @import("../../boot.zig");
+const intr = @import("intr.zig");
 const log = std.log.scoped(.@"x86-64.vm");
 const regs = @import("regs.zig");
+const smp = @import("../../smp.zig");
 const vm = @import("../../vm.zig");
 const utils = @import("../../utils.zig");
 
@@ -22,8 +25,36 @@ pub const lma_end = lma_start + lma_size;
 
 pub const heap_start = lma_end + utils.gb_size;
 
-const pt_pool_pages = 512;
 const pages_per_2mb = (utils.mb_size * 2) / page_size;
+const pages_per_gb = utils.gb_size / page_size;
+
+/// CPUID extended features leaf, EDX bit of the 1 GB pages support.
+const cpuid_ext_features = 0x8000_0001;
+const cpuid_pdpe1gb = 1 << 26;
+/// CPUID features leaf, ECX bit of the PCID support.
+const cpuid_pcid = 1 << 17;
+/// CPUID structured extended features leaf, EBX bit of the INVPCID support.
+const cpuid_ext_flags = 7;
+const cpuid_invpcid = 1 << 10;
+
+/// CPUID features leaf, EDX bit of the PAT support.
+const cpuid_pat = 1 << 16;
+
+/// PAT entries: the default ones, except the entry `1` (PWT) is write-combining
+/// instead of write-through. So `cache_disable` (PCD) still selects
+/// the uncached type and `write_combining` selects the entry `1`.
+const pat_value = 0x0007_0406_0007_0106;
+
+/// Number of address spaces each CPU keeps tagged in the TLB.
+pub const pcids_per_cpu = 6;
+
+/// CR3 bit to keep the TLB entries of the loaded PCID.
+const cr3_noflush = 1 << 63;
+const cr3_pcid_mask = 0xFFF;
+
+/// Number of pages up to which TLB entries are invalidated one by one with `invlpg`,
+/// the whole TLB is flushed for the bigger ranges.
+pub const tlb_flush_threshold = 32;
 
 const PageTableEntry = packed struct {
     present: u1 = 0,
@@ -55,6 +86,10 @@ const PageTableEntry = packed struct {
         result.user_access = if (flags.user) 1 else 0;
         result.global = if (flags.global) 1 else 0;
         result.cache_disabled = if (flags.cache_disable) 1 else 0;
+
+        if (flags.write_combining) {
+            if (pat_avail) result.write_through = 1 else result.cache_disabled = 1;
+        }
         result.size = if (flags.large) 1 else 0;
         result.exec_disabled = if (flags.exec) 0 else 1;
 
@@ -81,41 +116,187 @@ const PageTableEntry = packed struct {
 
 pub const PageTable = [page_table_size]PageTableEntry;
 
-var pt_oma: vm.ObjectAllocator = undefined;
+/// TLB shootdown request shared with the other CPUs.
+const Shootdown = struct {
+    lock: utils.Spinlock = utils.Spinlock.init(.unlocked),
+
+    virt: usize = 0,
+    pages: u32 = 0,
+
+    /// Number of CPUs that haven't flushed their TLB yet.
+    pending: std.atomic.Value(u16) = std.atomic.Value(u16).init(0),
+};
+
+/// Page tables detached by `unmap`.
+/// They are freed only after the TLB shootdown, until then
+/// other CPUs may still walk them through the paging-structure caches.
+const DetachedPts = struct {
+    head: ?*PageTable = null,
+
+    fn push(self: *DetachedPts, pt: *PageTable) void {
+        // The table isn't used anymore, the link is kept in its first entry
+        const link: *?*PageTable = @ptrCast(pt);
+        link.* = self.head;
+        self.head = pt;
+    }
+
+    fn freeAll(self: *DetachedPts) void {
+        while (self.head) |pt| {
+            const link: *?*PageTable = @ptrCast(pt);
+            self.head = link.*;
+
+            freePt(pt);
+        }
+    }
+};
+
+/// PCIDs of the address spaces recently used on a CPU.
+/// The PCID `0` is left for the page tables set before the PCIDs are enabled.
+pub const PcidCache = struct {
+    const Slot = struct {
+        pt: ?*const PageTable = null,
+        generation: u32 = 0,
+    };
+
+    slots: [pcids_per_cpu]Slot = .{Slot{}} ** pcids_per_cpu,
+    /// Round-robin victim on a miss.
+    next: u8 = 0,
+
+    /// Returns the PCID of the page table and
+    /// whether its TLB entries are still valid.
+    fn get(self: *PcidCache, pt: *const PageTable) struct { u12, bool } {
+        const generation = pt_generation.load(.acquire);
+
+        for (&self.slots, 1..) |*slot, pcid| {
+            if (slot.pt != pt) continue;
+
+            const is_valid = slot.generation == generation;
+            slot.generation = generation;
+
+            return .{ @truncate(pcid), is_valid };
+        }
+
+        const idx = self.next;
+        self.next = (self.next + 1) % pcids_per_cpu;
+        self.slots[idx] = .{ .pt = pt, .generation = generation };
+
+        return .{ @as(u12, idx) + 1, false };
+    }
+
+    /// Makes the PCIDs except the current one to be flushed on the next load.
+    fn invalidateOthers(self: *PcidCache, curr_pcid: u12) void {
+        for (&self.slots, 1..) |*slot, pcid| {
+            if (pcid != curr_pcid) slot.pt = null;
+        }
+    }
+};
+
+var shootdown = Shootdown{};
+/// Set if the CPU supports 1 GB pages.
+var gb_pages_avail = false;
+/// Set if PAT is programmed with the write-combining entry.
+var pat_avail = false;
+/// Set if PCIDs are enabled, see `PcidCache`.
+var pcid_avail = false;
+var invpcid_avail = false;
+
+/// Incremented when a top level page table is released,
+/// its physical page may be reused by another address space,
+/// so all cached PCIDs become invalid.
+var pt_generation = std.atomic.Value(u32).init(0);
 
 pub fn preinit() void {
+    gb_pages_avail = (arch.cpuid(cpuid_ext_features, undefined, undefined, undefined).d & cpuid_pdpe1gb) != 0;
+    const features = arch.cpuid(arch.cpuid_features, undefined, undefined, undefined);
+
+    pat_avail = (features.d & cpuid_pat) != 0;
+    pcid_avail = (features.c & cpuid_pcid) != 0;
+    invpcid_avail = pcid_avail and (arch.cpuid(cpuid_ext_flags, undefined, 0, undefined).b & cpuid_invpcid) != 0;
+
+    initCpu();
+
     earlyMmapDma();
     boot.switchToLma();
 }
 
-pub fn init() vm.Error!void {
-    const rank = std.math.log2(pt_pool_pages);
-    const oma_pool = vm.PageAllocator.alloc(rank) orelse return vm.Error.NoMemory;
+pub fn init() vm.Error!void {}
 
-    pt_oma = try vm.ObjectAllocator.initRaw(@sizeOf(PageTable), oma_pool, pt_pool_pages);
+/// Programs PAT and enables PCIDs on the current CPU if available.
+/// PAT must be the same on all CPUs.
+pub fn initCpu() void {
+    if (pat_avail) regs.setMsr(regs.MSR_PAT, pat_value);
+    if (!pcid_avail) return;
+
+    // CR3 must have PCID `0` when PCIDs are enabled
+    regs.setCr3(regs.getCr3() & ~@as(u64, cr3_pcid_mask));
+    regs.setCr4(regs.getCr4() | regs.CR4_PCIDE);
 }
 
 pub inline fn allocPt() ?*PageTable {
-    const pt = pt_oma.alloc(PageTable) orelse return null;
-    @memset(pt, PageTableEntry{});
-
-    return pt;
+    // Empty page table entries are zeros.
+    const phys = vm.PageAllocator.allocZeroed(0) orelse return null;
+    return @ptrFromInt(vm.getVirtLma(phys));
 }
 
 pub inline fn freePt(pt: *PageTable) void {
-    pt_oma.free(pt);
+    vm.PageAllocator.free(vm.getPhysLma(@intFromPtr(pt)), 0);
+}
+
+/// Fills pages with zeros using non-temporal stores,
+/// so the zeroed memory doesn't evict useful data from the cache.
+///
+/// - `virt`: Page aligned virtual address.
+/// - `pages`: Number of pages.
+pub fn zeroPages(virt: usize, pages: u32) void {
+    const line_size = 64;
+
+    var addr = virt;
+    const end = virt + (@as(usize, pages) * page_size);
+
+    while (addr < end) : (addr += line_size) {
+        asm volatile (
+            \\movnti %[zero],0x00(%[addr])
+            \\movnti %[zero],0x08(%[addr])
+            \\movnti %[zero],0x10(%[addr])
+            \\movnti %[zero],0x18(%[addr])
+            \\movnti %[zero],0x20(%[addr])
+            \\movnti %[zero],0x28(%[addr])
+            \\movnti %[zero],0x30(%[addr])
+            \\movnti %[zero],0x38(%[addr])
+            :
+            : [addr] "r" (addr),
+              [zero] "r" (@as(u64, 0)),
+            : "memory"
+        );
+    }
+
+    // Non-temporal stores are weakly ordered
+    asm volatile ("sfence" ::: "memory");
 }
 
 pub inline fn getPt() *PageTable {
-    const pt: *PageTable = @ptrFromInt(regs.getCr3() & (~@as(usize, 0xFFF)));
+    const pt: *PageTable = @ptrFromInt(regs.getCr3() & (~@as(usize, cr3_pcid_mask)));
     return vm.getVirtLma(pt);
 }
 
-pub inline fn setPt(pt: *const PageTable) void {
+/// Loads the page table. With PCIDs the TLB entries of the address space
+/// are kept if they are still valid since it was used on this CPU last time.
+pub fn setPt(pt: *const PageTable) void {
     const pt_phys = vm.getPhysLma(@intFromPtr(pt));
-    const cr3 = pt_phys | (regs.getCr3() & @as(u64, 0xFFF));
 
-    regs.setCr3(cr3);
+    if (!pcid_avail) {
+        return regs.setCr3(pt_phys | (regs.getCr3() & @as(u64, cr3_pcid_mask)));
+    }
+
+    const pcid, const is_valid = getPcidCache().get(pt);
+    regs.setCr3(pt_phys | pcid | @as(u64, if (is_valid) cr3_noflush else 0));
+}
+
+/// Must be called before the top level page table is freed,
+/// so its PCIDs are not reused for another address space.
+pub fn releasePt(pt: *const PageTable) void {
+    _ = pt;
+    if (pcid_avail) _ = pt_generation.fetchAdd(1, .acq_rel);
 }
 
 pub inline fn clonePt(src_pt: *const PageTable, dest_pt: *PageTable) void {
@@ -194,9 +375,12 @@ fn logPte(pte: *const PageTableEntry, len: u16, level: u3) void {
     }
 }
 
+/// Maps the LMA region with 1 GB pages, or with 2 MB pages
+/// if the CPU doesn't support them.
 fn earlyMmapDma() void {
     const pt = vm.getPhysLma(getPt());
     const p4_idx = getPxeIdx(3, lma_start);
+    const len = lma_size / utils.gb_size;
 
     const pt3: *PageTable = @ptrFromInt(boot.alloc(1).?);
     @memset(@as(*[page_table_size]u64, @ptrCast(pt3))[0..page_table_size], 0);
@@ -208,12 +392,26 @@ fn earlyMmapDma() void {
         0,
         vm.MapFlags{ .write = true, .global = true, .large = true }
     );
-    const len = lma_size / utils.gb_size;
-    const gb_pages = utils.gb_size / vm.page_size;
 
-    for (pt3[0..len]) |*entry| {
-        entry.* = template_pte;
-        template_pte.base += gb_pages;
+    if (gb_pages_avail) {
+        for (pt3[0..len]) |*entry| {
+            entry.* = template_pte;
+            template_pte.base += pages_per_gb;
+        }
+
+        return;
+    }
+
+    // A page directory per each gigabyte
+    const pts2: [*]PageTable = @ptrFromInt(boot.alloc(len).?);
+
+    for (pt3[0..len], pts2[0..len]) |*entry, *pt2| {
+        entry.* = PageTableEntry.init(@intFromPtr(pt2), vm.MapFlags{ .write = true });
+
+        for (pt2) |*pt2_entry| {
+            pt2_entry.* = template_pte;
+            template_pte.base += pages_per_2mb;
+        }
     }
 }
 
@@ -252,7 +450,7 @@ pub fn mmap(virt: usize, phys: usize, pages: u32, flags: vm.MapFlags, page_table
 
     var max_pt: u8 = 3;
     if (pte_flags.large) {
-        max_pt = if (pages >= (utils.gb_size / page_size) and
+        max_pt = if (gb_pages_avail and pages >= pages_per_gb and
             (virt % utils.gb_size) == 0 and
             (phys % utils.gb_size) == 0) 1 else 2;
     }
@@ -270,6 +468,9 @@ pub fn mmap(virt: usize, phys: usize, pages: u32, flags: vm.MapFlags, page_table
                 pte[0] = template_pte;
                 pte[0].size = 0;
                 pte[0].global = 0;
+                // Page tables themselves are never write-combined or uncached
+                pte[0].write_through = 0;
+                pte[0].cache_disabled = 0;
                 pte[0].base = @truncate(@intFromPtr(vm.getPhysLma(new_pt)) / page_size);
             } else if (pte[0].size == 1) {
                 // Remap large page
@@ -298,7 +499,7 @@ pub fn mmap(virt: usize, phys: usize, pages: u32, flags: vm.MapFlags, page_table
             if (pte_flags.large) {
                 switch (max_pt) {
                     1 => {
-                        pages_step = utils.gb_size / page_size;
+                        pages_step = pages_per_gb;
                         entries_to_map /= pages_step;
                     },
                     2 => {
@@ -352,6 +553,145 @@ pub fn mmap(virt: usize, phys: usize, pages: u32, flags: vm.MapFlags, page_table
     unreachable;
 }
 
+/// Unmaps the pages and frees the page tables left empty, except the tables
+/// referenced from the top level one: they are shared between all page tables (see `clonePt`).
+/// The TLB entries of the range are invalidated on all CPUs with a single shootdown.
+/// 
+/// Large pages partially covered by the range are split, that is the only case of failure.
+pub fn unmap(virt: usize, pages: u32, page_table: *PageTable) vm.Error!void {
+    std.debug.assert(virt % page_size == 0 and pages > 0);
+
+    var detached = DetachedPts{};
+    defer {
+        flushTlb(virt, pages);
+        detached.freeAll();
+    }
+
+    const last = virt + (@as(usize, pages) * page_size) - 1;
+    _ = try unmapLevel(page_table, 3, virt, last, &detached);
+}
+
+/// Invalidates the TLB entries of the range on all CPUs.
+/// Each other CPU gets a single IPI, the function returns when all of them
+/// have flushed. Must be called with interrupts enabled and not from
+/// an interrupt handler, otherwise the IPIs can't be handled.
+pub fn flushTlb(virt: usize, pages: u32) void {
+    const cpus_num = smp.getNum();
+    if (cpus_num == 1) return flushTlbLocal(virt, pages);
+
+    std.debug.assert(intr.isEnabledForCpu());
+
+    // The CPU holding the lock may wait for this one to flush
+    while (!shootdown.lock.tryLock()) {
+        handleTlbShootdown();
+        std.atomic.spinLoopHint();
+    }
+    defer shootdown.lock.unlock();
+
+    shootdown.virt = virt;
+    shootdown.pages = pages;
+
+    const cpu_idx = smp.getIdx();
+
+    for (0..cpus_num) |i| {
+        const target: u16 = @truncate(i);
+        if (target == cpu_idx or !intr.isIpiReady(target)) continue;
+
+        _ = shootdown.pending.fetchAdd(1, .acq_rel);
+        smp.getCpuData(target).arch_specific.tlb_pending.store(true, .release);
+
+        intr.sendIpi(target, intr.tlb_vec);
+    }
+
+    flushTlbLocal(virt, pages);
+
+    while (shootdown.pending.load(.acquire) != 0) std.atomic.spinLoopHint();
+}
+
+/// Invalidates the TLB entries of the range on the current CPU only.
+/// `invlpg` affects only the current PCID, entries of the other
+/// cached PCIDs are invalidated with `invpcid` or dropped with their PCIDs.
+pub fn flushTlbLocal(virt: usize, pages: u32) void {
+    if (pages > tlb_flush_threshold) return flushTlbAll();
+
+    for (0..pages) |i| regs.invlpg(virt + (i * page_size));
+
+    if (!pcid_avail) return;
+
+    const cache = getPcidCache();
+    const curr_pcid: u12 = @truncate(regs.getCr3() & cr3_pcid_mask);
+
+    if (!invpcid_avail) return cache.invalidateOthers(curr_pcid);
+
+    for (cache.slots, 1..) |slot, pcid| {
+        if (pcid == curr_pcid or slot.pt == null) continue;
+
+        for (0..pages) |i| regs.invpcid(0, @truncate(pcid), virt + (i * page_size));
+    }
+}
+
+/// Flushes the whole TLB of the current CPU including the global pages and all PCIDs.
+pub fn flushTlbAll() void {
+    if (invpcid_avail) return regs.invpcid(2, 0, 0);
+
+    const cr4 = regs.getCr4();
+
+    regs.setCr4(cr4 & ~@as(u64, regs.CR4_PGE));
+    regs.setCr4(cr4);
+}
+
+inline fn getPcidCache() *PcidCache {
+    return &smp.getLocalData().arch_specific.pcids;
+}
+
+/// Called on the TLB shootdown IPI and while waiting for the shootdown lock.
+/// Does nothing if there is no request for the current CPU,
+/// so the request is handled once even if the IPI comes later.
+pub fn handleTlbShootdown() void {
+    const local_data = &smp.getLocalData().arch_specific;
+    if (!local_data.tlb_pending.swap(false, .acq_rel)) return;
+
+    flushTlbLocal(shootdown.virt, shootdown.pages);
+    _ = shootdown.pending.fetchSub(1, .acq_rel);
+}
+
+/// Unmaps the range `[first, last]` from the page table of the `level`.
+/// 
+/// - Returns: `true` if the page table has no present entries anymore.
+fn unmapLevel(pt: *PageTable, level: u8, first: usize, last: usize, detached: *DetachedPts) vm.Error!bool {
+    const entry_mask = (@as(usize, page_size) << @truncate(level * 9)) - 1;
+    var addr = first;
+
+    while (true) {
+        const pte = &pt[getPxeIdx(level, addr)];
+        const entry_last = addr | entry_mask;
+        const chunk_last = @min(entry_last, last);
+
+        if (pte.present != 0) {
+            const is_whole = (addr & entry_mask) == 0 and chunk_last == entry_last;
+
+            if (level == 0 or (pte.size == 1 and is_whole)) {
+                pte.* = .{};
+            } else {
+                if (pte.size == 1) try remapLarge(pte, level == 2);
+
+                const next_pt = pte.nextPt();
+
+                if (try unmapLevel(next_pt, level - 1, addr, chunk_last, detached) and level < 3) {
+                    pte.* = .{};
+                    detached.push(next_pt);
+                }
+            }
+        }
+
+        if (chunk_last == last) break;
+        addr = chunk_last + 1;
+    }
+
+    const entries: *const [page_table_size]u64 = @ptrCast(pt);
+    return std.mem.allEqual(u64, entries, 0);
+}
+
 fn correctMmapFlags(flags: vm.MapFlags, virt: usize, phys: usize, pages: u32) vm.MapFlags {
     var result = flags;
 
@@ -373,6 +713,9 @@ fn remapLarge(pte: *PageTableEntry, is_gb_page: bool) vm.Error!void {
     pte.base = @truncate(@intFromPtr(vm.getPhysLma(pt)) / page_size);
     pte.size = 0;
     pte.global = 0;
+    // The new page table is accessed write-back, like in `mmap`
+    pte.write_through = 0;
+    pte.cache_disabled = 0;
 
     const pages_step: u16 = if (is_gb_page) pages_per_2mb else 1;
 
@@ -0,0 +1,406 @@
+//! # Kernel microbenchmarks
+//!
+//! A set of small benchmarks for the kernel hot paths.
+//! They are executed once after the kernel initialization
+//! if the kernel is built with `-Dbench=true`.
+//!
+//! Results are printed to the log in CPU cycles (see `utils.profileBegin`).
+
+// Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
+
+const std = @import("std");
+
+const boot = @import("boot.zig");
+const log = std.log.scoped(.bench);
+const utils = @import("utils.zig");
+const video = @import("video.zig");
+const vm = @import("vm.zig");
+
+/// Runs all benchmarks.
+pub fn run() void {
+    log.warn("running microbenchmarks", .{});
+
+    pageFree();
+    objectLookup();
+    bitmapFind();
+    lazyFault();
+    vmalloc();
+    ptSwitch();
+    fbRedraw();
+}
+
+/// Measures `vm.PageAllocator.free` latency with the different length of the free list.
+/// Each measured free merges a block with its buddy placed in the list, so the
+/// latency has to stay flat regardless of the list length. The reported length is
+/// the number of free blocks of the freed rank right before the measured frees.
+fn pageFree() void {
+    const PageAllocator = vm.PageAllocator;
+
+    // Bypass per-CPU lists, the blocks must go directly to the buddy lists.
+    const rank = PageAllocator.pcp_max_rank + 1;
+    const lengths = [_]u32{ 16, 64, 256, 1024 };
+    const max_blocks = lengths[lengths.len - 1] * 2;
+
+    const pool_pages = std.math.divCeil(u32, max_blocks * @sizeOf(usize), vm.page_size) catch unreachable;
+    const pool_rank = std.math.log2_int_ceil(u32, pool_pages);
+
+    const pool_phys = PageAllocator.alloc(pool_rank) orelse return;
+    defer PageAllocator.free(pool_phys, pool_rank);
+
+    const blocks: [*]usize = @ptrFromInt(vm.getVirtLma(pool_phys));
+    const block_size = (@as(usize, 1) << rank) * vm.page_size;
+
+    for (lengths) |len| {
+        const num = len * 2;
+        const free_pages = PageAllocator.getTotalPages() - PageAllocator.getAllocatedPages();
+
+        if ((num << rank) > free_pages / 4) {
+            log.warn("page free: {} pre-freed blocks: skipped, not enough memory", .{len});
+            continue;
+        }
+
+        var allocated: u32 = 0;
+        while (allocated < num) : (allocated += 1) {
+            blocks[allocated] = PageAllocator.alloc(rank) orelse break;
+        }
+
+        // Free the left buddies to fill the free list,
+        // right buddies remain allocated and prevent coalescing.
+        for (blocks[0..allocated]) |block| {
+            if ((block / block_size) % 2 == 0) PageAllocator.free(block, rank);
+        }
+
+        const list_len = getFreeListLen(rank);
+
+        var cycles: usize = 0;
+        var freed: u32 = 0;
+
+        for (blocks[0..allocated]) |block| {
+            if ((block / block_size) % 2 == 0) continue;
+
+            const begin = utils.profileBegin();
+            PageAllocator.free(block, rank);
+            cycles += utils.profileEnd(begin);
+
+            freed += 1;
+        }
+
+        log.warn("page free: rank {} list length {}: {} cycles per free", .{
+            rank, list_len, if (freed > 0) cycles / freed else 0
+        });
+    }
+}
+
+/// Measures lookups over objects allocated with `vm.ObjectAllocator`
+/// packed, aligned to the cache line, and aligned with colouring.
+/// Each lookup reads the key and the tail of an object picked by a hash,
+/// like a hash table probe. Random lookups go over all objects of many arenas.
+/// Hot lookups go over the first objects of `hot_max` arenas: without colouring
+/// they share the same offset in the page, so compete for one cache set.
+fn objectLookup() void {
+    // 256 bytes aligned, leaves room for 3 colours in an arena
+    const Object = struct {
+        key: usize,
+        data: [25]usize,
+    };
+
+    const objects_num = 4096;
+    const lookups = 65536;
+    // Fits 8-way L1 sets if the objects are spread over 3 colours
+    const hot_max = 24;
+
+    // Pointers to all objects followed by the hot ones
+    const pool_pages = std.math.divCeil(u32, (objects_num + hot_max) * @sizeOf(usize), vm.page_size) catch unreachable;
+    const pool_rank = std.math.log2_int_ceil(u32, pool_pages);
+
+    const pool_phys = vm.PageAllocator.alloc(pool_rank) orelse return;
+    defer vm.PageAllocator.free(pool_phys, pool_rank);
+
+    const objects: [*]*Object = @ptrFromInt(vm.getVirtLma(pool_phys));
+    const hot = objects + objects_num;
+
+    const configs = [_]struct { name: []const u8, options: vm.ObjectAllocator.Options }{
+        .{ .name = "packed", .options = .{} },
+        .{ .name = "aligned", .options = .{ .alignment = utils.cache_line_size } },
+        .{ .name = "aligned, coloured", .options = .{ .alignment = utils.cache_line_size, .colouring = true } },
+    };
+
+    inline for (configs) |config| {
+        var oma = vm.ObjectAllocator.initSizedEx(@sizeOf(Object), 1, config.options);
+        defer oma.deinit();
+
+        var allocated: u32 = 0;
+        var hot_num: u32 = 0;
+        var last_page: usize = 0;
+
+        while (allocated < objects_num) : (allocated += 1) {
+            const obj = oma.alloc(Object) orelse break;
+            obj.key = allocated;
+
+            objects[allocated] = obj;
+
+            // The first object of the arena
+            const page = @intFromPtr(obj) / vm.page_size;
+            if (page != last_page and hot_num < hot_max) {
+                hot[hot_num] = obj;
+                hot_num += 1;
+                last_page = page;
+            }
+        }
+
+        if (allocated > 0) {
+            var found: usize = 0;
+            var hash: u32 = 1;
+
+            var begin = utils.profileBegin();
+            for (0..lookups) |_| {
+                hash = xorshift(hash);
+                const obj = objects[hash % allocated];
+
+                if (obj.key == hash) found +%= obj.data[obj.data.len - 1];
+            }
+            const random_cycles = utils.profileEnd(begin);
+
+            begin = utils.profileBegin();
+            for (0..lookups) |_| {
+                hash = xorshift(hash);
+                const obj = hot[hash % hot_num];
+
+                if (obj.key == hash) found +%= obj.data[obj.data.len - 1];
+            }
+            const hot_cycles = utils.profileEnd(begin);
+
+            std.mem.doNotOptimizeAway(found);
+
+            log.warn("object lookup: {s}: random {} cycles, hot ({} objects) {} cycles per lookup", .{
+                config.name, random_cycles / lookups, hot_num, hot_cycles / lookups
+            });
+        }
+    }
+}
+
+/// Measures `utils.Bitmap.find` against the byte by byte loop
+/// on a bitmap where the only clear bit is the last one.
+fn bitmapFind() void {
+    const sizes = [_]u32{ 64, 512, 4096, 32768 };
+    const repeats = 64;
+
+    const pool_rank = std.math.log2_int_ceil(u32, sizes[sizes.len - 1] / vm.page_size);
+
+    const pool_phys = vm.PageAllocator.alloc(pool_rank) orelse return;
+    defer vm.PageAllocator.free(pool_phys, pool_rank);
+
+    const pool: [*]u8 = @ptrFromInt(vm.getVirtLma(pool_phys));
+
+    for (sizes) |size| {
+        var bitmap = utils.Bitmap.init(pool[0..size], true);
+        bitmap.clear(size * utils.byte_size - 1);
+
+        var found: usize = 0;
+
+        var begin = utils.profileBegin();
+        for (0..repeats) |_| found +%= byteFind(bitmap.bits) orelse 0;
+        const byte_cycles = utils.profileEnd(begin);
+
+        begin = utils.profileBegin();
+        for (0..repeats) |_| found +%= bitmap.find(false) orelse 0;
+        const word_cycles = utils.profileEnd(begin);
+
+        std.mem.doNotOptimizeAway(found);
+
+        log.warn("bitmap find: {} bytes: byte loop {} cycles, word-wide {} cycles", .{
+            size, byte_cycles / repeats, word_cycles / repeats
+        });
+    }
+}
+
+/// Measures the page faults of a lazy `vm.VirtualRegion` touched with a stride
+/// of the pages, with and without the fault-around. Reports the resident set
+/// of the region (see `vm.VirtualRegion.getStats`) after the touches.
+fn lazyFault() void {
+    const pages = 1024;
+    const stride = 4;
+
+    const ranks = [_]u8{ 0, 4 };
+
+    for (ranks) |rank| {
+        const base = vm.heapReserve(pages);
+        defer vm.heapRelease(base, pages);
+
+        var region = vm.VirtualRegion.init(base);
+        region.makeLazy(pages, .{ .write = true, .global = true }, rank);
+        defer region.deinit();
+
+        var touched: u32 = 0;
+        var page: u32 = 0;
+
+        const begin = utils.profileBegin();
+
+        while (page < pages) : (page += stride) {
+            const ptr: *volatile u8 = @ptrFromInt(base + (@as(usize, page) * vm.page_size));
+            ptr.* = 1;
+
+            touched += 1;
+        }
+
+        const cycles = utils.profileEnd(begin);
+        const stats = region.getStats();
+
+        log.warn("lazy fault: fault-around rank {}: {} cycles per touch, {} faults, {}/{} pages resident", .{
+            rank, cycles / touched, stats.faults, stats.resident_pages, stats.reserved_pages
+        });
+    }
+}
+
+/// Measures `vm.vmalloc`/`vm.vfree` of a small and a large buffer, writes
+/// and verifies the whole buffer. Counts the 2 MB parts of the buffer
+/// backed by an aligned contiguous block, they are mapped with large pages.
+fn vmalloc() void {
+    const sizes = [_]usize{ 256 * utils.kb_size, 8 * utils.mb_size };
+    const large_size = 2 * utils.mb_size;
+
+    for (sizes) |size| {
+        var begin = utils.profileBegin();
+        const ptr = vm.vmalloc(size) orelse {
+            log.warn("vmalloc: {} KB: skipped, not enough memory", .{size / utils.kb_size});
+            continue;
+        };
+        const alloc_cycles = utils.profileEnd(begin);
+
+        const words: [*]volatile usize = @ptrCast(@alignCast(ptr));
+        const words_num = size / @sizeOf(usize);
+
+        for (0..words_num) |i| words[i] = i;
+
+        var is_valid = true;
+        for (0..words_num) |i| {
+            if (words[i] != i) is_valid = false;
+        }
+
+        var large_blocks: usize = 0;
+        var offset: usize = 0;
+
+        while (offset + large_size <= size) : (offset += large_size) {
+            const virt = @intFromPtr(ptr) + offset;
+            const first = vm.getPhys(virt) orelse break;
+            const last = vm.getPhys(virt + large_size - vm.page_size) orelse break;
+
+            if (first % large_size == 0 and last - first == large_size - vm.page_size) large_blocks += 1;
+        }
+
+        begin = utils.profileBegin();
+        vm.vfree(ptr);
+        const free_cycles = utils.profileEnd(begin);
+
+        log.warn("vmalloc: {} KB: alloc {} cycles, free {} cycles, {}/{} large blocks, data {s}", .{
+            size / utils.kb_size, alloc_cycles, free_cycles,
+            large_blocks, size / large_size, if (is_valid) "ok" else "corrupted"
+        });
+    }
+}
+
+/// Measures `vm.setPt` switching between a few address spaces created with `vm.newPt`,
+/// while they are tagged in the TLB and after `vm.deletePt` released one of them,
+/// which makes the tags of the others stale. The address spaces are freed with `vm.deletePt`.
+fn ptSwitch() void {
+    const pts_num = 4;
+    const rounds = 64;
+
+    const orig_pt = vm.getPt();
+    var pts: [pts_num]*vm.PageTable = undefined;
+    var created: u32 = 0;
+
+    defer for (pts[0..created]) |pt| vm.deletePt(pt);
+
+    while (created < pts_num) : (created += 1) {
+        pts[created] = vm.newPt() orelse {
+            log.warn("pt switch: skipped, not enough memory", .{});
+            return;
+        };
+    }
+
+    // Tag all the address spaces
+    for (pts) |pt| vm.setPt(pt);
+
+    var begin = utils.profileBegin();
+    for (0..rounds) |_| {
+        for (pts) |pt| vm.setPt(pt);
+    }
+    const tagged_cycles = utils.profileEnd(begin);
+
+    vm.setPt(orig_pt);
+
+    // Released address space invalidates the tags of the others
+    vm.deletePt(pts[pts_num - 1]);
+    created -= 1;
+
+    begin = utils.profileBegin();
+    for (pts[0..created]) |pt| vm.setPt(pt);
+    const released_cycles = utils.profileEnd(begin);
+
+    vm.setPt(orig_pt);
+
+    log.warn("pt switch: tagged {} cycles, after release {} cycles per switch", .{
+        tagged_cycles / (rounds * pts_num), released_cycles / created
+    });
+}
+
+/// Measures the full screen redraw of `video.terminal`
+/// with the uncached and the write-combining framebuffer.
+fn fbRedraw() void {
+    const terminal = video.terminal;
+    const repeats = 8;
+
+    var uc_flags = terminal.fb_map_flags;
+    uc_flags.write_combining = false;
+    uc_flags.cache_disable = true;
+
+    const configs = [_]struct { name: []const u8, flags: vm.MapFlags }{
+        .{ .name = "uncached", .flags = uc_flags },
+        .{ .name = "write-combining", .flags = terminal.fb_map_flags },
+    };
+
+    for (configs) |config| {
+        boot.remapFb(config.flags) catch return;
+
+        const begin = utils.profileBegin();
+        for (0..repeats) |_| terminal.redraw();
+        const cycles = utils.profileEnd(begin);
+
+        log.warn("fb redraw: {s}: {} cycles per screen", .{config.name, cycles / repeats});
+    }
+}
+
+/// Reference byte by byte search of the first clear bit.
+fn byteFind(bits: []const u8) ?usize {
+    for (bits, 0..) |byte, byte_idx| {
+        if (byte == 0xFF) continue;
+
+        for (0..utils.byte_size) |i| {
+            if ((byte & (@as(u8, 1) << @truncate(i))) == 0) return (byte_idx * utils.byte_size) + i;
+        }
+    }
+
+    return null;
+}
+
+/// Xorshift hash of the benchmark access patterns.
+inline fn xorshift(value: u32) u32 {
+    var x = value;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return x;
+}
+
+/// Returns the number of free blocks of the rank over all mobility types and nodes.
+fn getFreeListLen(rank: u32) usize {
+    var len: usize = 0;
+
+    for (std.enums.values(vm.PageAllocator.Mobility)) |mobility| {
+        len += vm.PageAllocator.getMobilityStats(mobility).free_blocks[rank];
+    }
+
+    return len;
+}
@@ -77,7 +77,7 @@ pub const MemMap = struct {
 
         if (idx == self.len) return;
 
-        for (0..self.len) |i| {
+        for (idx..self.len) |i| {
             self.entries[i] = self.entries[i + 1];
         }
     }
@@ -101,6 +101,9 @@ const MappingEntry = struct {
     }
 };
 
+/// Size of the framebuffer mapping.
+pub const fb_map_size = 16 * utils.mb_size;
+
 /// A null mapping entry used as a placeholder.
 const mapNull = MappingEntry.init(0, 0, 0, .{});
 
@@ -117,6 +120,16 @@ fn makeColorFmt(bb_fmt: u8) Framebuffer.ColorFormat {
     };
 }
 
+/// Remaps the framebuffer with the flags, e.g. to change its memory type.
+/// 
+/// - `flags`: new mapping flags, see `vm.MapFlags`.
+pub fn remapFb(flags: vm.MapFlags) vm.Error!void {
+    const pages = fb_map_size / vm.page_size;
+
+    try vm.mmap(@intFromPtr(&fb), bootboot.fb_ptr, pages, flags, vm.getRootPt());
+    vm.flushTlb(@intFromPtr(&fb), pages);
+}
+
 /// Populates the framebuffer structure with information provided by the bootloader.
 pub fn getFb(fb_ptr: *Framebuffer) void {
     fb_ptr.* = .{
@@ -144,7 +157,7 @@ pub fn getMappings() vm.Error![]MappingEntry {
         .{ .write = true, .global = true, .large = true }
     );
     mappings[@intFromEnum(Order.Fb)] = MMap.init(
-        @intFromPtr(&fb), bootboot.fb_ptr, 16 * utils.mb_size,
+        @intFromPtr(&fb), bootboot.fb_ptr, fb_map_size,
         .{ .write = true, .global = true, .large = true, .cache_disable = true }
     );
     mappings[@intFromEnum(Order.Boot)] = MMap.init(
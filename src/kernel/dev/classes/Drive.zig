@@ -15,9 +15,16 @@ const vfs = @import("../../vfs.zig");
 const Self = @This();
 
 const IoQueue = utils.SList(IoRequest);
-const IoOma = vm.SafeOma(IoQueue.Node);
 
-const io_oma_capacity = 198;
+/// Preallocated I/O request, padded to the cache line size.
+/// Requests are completed on other CPUs, so they must not share cache lines.
+const IoSlot = struct {
+    node: IoQueue.Node align(utils.cache_line_size),
+};
+
+/// Number of the preallocated I/O requests,
+/// the request id is it's index in the pool.
+const io_requests_num = 198;
 
 pub const Error = error {
     IoFailed,
@@ -77,7 +84,9 @@ is_multi_io: bool = false,
 is_partitionable: bool = false,
 
 io: Io = undefined,
-io_oma: IoOma = undefined,
+io_requests: []IoSlot = &.{},
+io_free: IoQueue = .{},
+io_free_lock: utils.Spinlock = .{},
 
 cache_ctrl: *cache.ControlBlock = undefined,
 parts: vfs.parts.List = .{},
@@ -107,9 +116,22 @@ pub fn init(self: *Self, name: []const u8, multi_io: bool, partitions: bool) Err
         self.io = .{ .single = .{} };
     }
 
+    {
+        const mem = vm.malloc(io_requests_num * @sizeOf(IoSlot)) orelse return error.NoMemory;
+        const requests: [*]IoSlot = @alignCast(@ptrCast(mem));
+
+        self.io_requests = requests[0..io_requests_num];
+        self.io_free = .{};
+        self.io_free_lock = .{};
+
+        for (self.io_requests, 0..) |*slot, i| {
+            slot.node.data.id = @truncate(i);
+            self.io_free.prepend(&slot.node);
+        }
+    }
+
     self.base_name = name;
     self.lba_shift = std.math.log2_int(u16, self.lba_size);
-    self.io_oma = IoOma.init(io_oma_capacity);
 
     log.info("init: {s}; lba size: {}; capacity: {} MiB", .{
         self.base_name, self.lba_size, self.capacity / utils.mb_size
@@ -132,7 +154,7 @@ pub fn init(self: *Self, name: []const u8, multi_io: bool, partitions: bool) Err
 
 pub fn deinit(self: *Self) void {
     if (self.is_multi_io) vm.free(self.io.multi);
-    self.io_oma.deinit();
+    vm.free(self.io_requests.ptr);
 
     cache.deleteCtrl(self.cache_ctrl);
 }
@@ -155,29 +177,17 @@ pub fn nextRequest(self: *Self) ?*const IoRequest {
 }
 
 pub fn completeIo(self: *Self, id: u16, status: IoRequest.Status) void {
-    // Hope that this function will complete much faster
-    // then new arena would be allocated (in case if many I/O requests would be emited).
-    //
-    // Due to unlikelihood, we assume that this will never happen and we may not use lock.
-
-    const arena_idx = id / self.io_oma.oma.arena_capacity;
-    var node = self.io_oma.oma.arenas.first orelse unreachable;
-
-    for (0..arena_idx) |_| {
-        node = node.next orelse unreachable;
-    }
-
-    const request: *IoQueue.Node = @ptrFromInt(node.data.getBase() + (@sizeOf(IoQueue.Node) * id));
+    const request = &self.io_requests[id].node;
     const callback = request.data.callback;
 
     std.debug.assert(request.data.id == id);
     callback(&request.data, status);
 
     { // Free request node
-        self.io_oma.lock.lock();
-        defer self.io_oma.lock.unlock();
+        self.io_free_lock.lock();
+        defer self.io_free_lock.unlock();
 
-        self.io_oma.oma.freeRaw(node, @intFromPtr(request));
+        self.io_free.prepend(request);
     }
 }
 
@@ -317,29 +327,8 @@ fn submitRequest(self: *Self, request: *IoQueue.Node) bool {
 }
 
 fn allocRequest(self: *Self) ?*IoQueue.Node {
-    const oma = &self.io_oma.oma;
-
-    self.io_oma.lock.lock();
-    defer self.io_oma.lock.unlock();
-
-    var idx: u32 = 0;
-    var node = oma.arenas.first;
-
-    while (node) |arena| : ({node = arena.next; idx += 1;}) {
-        if (arena.data.alloc_num < oma.arena_capacity) break;
-    }
-
-    if (node == null) node = oma.newArena();
-
-    if (node) |arena| {
-        const addr = arena.data.alloc(@sizeOf(IoQueue.Node));
-        const request: *IoQueue.Node = @ptrFromInt(addr);
-
-        const inner_idx = (addr - arena.data.getBase()) / @sizeOf(IoQueue.Node);
-        request.data.id = @truncate((idx * oma.arena_capacity) + inner_idx);
-
-        return request;
-    }
+    self.io_free_lock.lock();
+    defer self.io_free_lock.unlock();
 
-    return null;
+    return self.io_free.popFirst();
 }
\ No newline at end of file
@@ -543,7 +543,7 @@ const Controller = struct {
     }
 
     fn initAdminQueues(self: *Controller) !void {
-        const pool_phys = vm.PageAllocator.alloc(1) orelse return error.NoMemory;
+        const pool_phys = vm.PageAllocator.allocZeroed(1) orelse return error.NoMemory;
 
         const sub_phys = pool_phys;
         const cmpl_phys = pool_phys + vm.page_size;
@@ -554,8 +554,6 @@ const Controller = struct {
         self.admin_submission = SubmissionQueue.init(sq[0..sq_len]);
         self.admin_completion = CompletionQueue.init(cq[0..cq_len]);
 
-        @memset(cq[0..cq_len], std.mem.zeroes(CompletionEntry));
-
         self.bar.set(.aqa, BarRegs.AdminQueueAttributes{
             .sub_queue_size = sq_len - 1,
             .cmpl_queue_size = cq_len - 1,
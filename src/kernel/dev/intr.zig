@@ -239,6 +239,24 @@ const Cpu = struct {
 
 pub const max_intr = 128;
 
+/// Disables interrupts on the current CPU.
+/// Returns `true` if they were enabled, it must be passed to `restoreForCpu`.
+pub const saveAndDisableForCpu = arch.intr.saveAndDisableForCpu;
+/// Enables interrupts on the current CPU if they were enabled
+/// before the `saveAndDisableForCpu` call.
+pub const restoreForCpu = arch.intr.restoreForCpu;
+/// Checks if interrupts are enabled on the current CPU.
+pub const isEnabledForCpu = arch.intr.isEnabledForCpu;
+/// Enables interrupts and halts the current CPU until the next interrupt,
+/// e.g. the one sent by `wakeCpu` while the interrupts were disabled.
+pub const waitForCpu = arch.intr.waitForCpu;
+
+/// Wakes up the CPU halted in `waitForCpu`.
+/// Does nothing if the CPU can't receive IPIs yet.
+pub fn wakeCpu(cpu_idx: u16) void {
+    if (arch.intr.isIpiReady(cpu_idx)) arch.intr.sendIpi(cpu_idx, arch.intr.wake_vec);
+}
+
 /// @noexport
 const max_cpus = 128;
 
@@ -281,6 +299,11 @@ pub fn init() !void {
         cpus_order.set(i, cpu);
     }
 
+    // Vectors of the inter-processor interrupts are the same on all CPUs
+    for (0..cpus_num) |i| {
+        reserveVectors(@truncate(i), arch.intr.ipi_vec_base, arch.intr.ipi_vectors_num);
+    }
+
     chip = try arch.intr.init();
 
     @memset(std.mem.asBytes(&msis.buffer), 0);
@@ -47,9 +47,157 @@ pub const Xsdt = extern struct {
     }
 };
 
+/// System Resource Affinity Table.
+/// Describes the proximity domains (NUMA nodes) of the processors and memory ranges.
+pub const Srat = extern struct {
+    pub const Entry = extern struct {
+        pub const Type = enum(u8) {
+            proc_lapic = 0x0,
+            memory = 0x1,
+            proc_x2apic = 0x2,
+            _
+        };
+
+        type: Type,
+        length: u8
+    };
+
+    pub const ProcLapic = extern struct {
+        pub const enabled_flag = 0x1;
+
+        header: Entry,
+        domain_lo: u8,
+        apic_id: u8,
+        flags: u32 align(1),
+        sapic_eid: u8,
+        domain_hi: [3]u8,
+        clock_domain: u32 align(1),
+
+        comptime {
+            std.debug.assert(@sizeOf(@This()) == 16);
+        }
+
+        pub inline fn getDomain(self: *const ProcLapic) u32 {
+            return self.domain_lo |
+                (@as(u32, self.domain_hi[0]) << 8) |
+                (@as(u32, self.domain_hi[1]) << 16) |
+                (@as(u32, self.domain_hi[2]) << 24);
+        }
+    };
+
+    pub const Memory = extern struct {
+        pub const enabled_flag = 0x1;
+        pub const hotplug_flag = 0x2;
+
+        header: Entry,
+        domain: u32 align(1),
+        reserved: u16 align(1),
+        base_lo: u32 align(1),
+        base_hi: u32 align(1),
+        length_lo: u32 align(1),
+        length_hi: u32 align(1),
+        reserved_1: u32 align(1),
+        flags: u32 align(1),
+        reserved_2: u64 align(1),
+
+        comptime {
+            std.debug.assert(@sizeOf(@This()) == 40);
+        }
+
+        pub inline fn getBase(self: *const Memory) usize {
+            return self.base_lo | (@as(usize, self.base_hi) << 32);
+        }
+
+        pub inline fn getLength(self: *const Memory) usize {
+            return self.length_lo | (@as(usize, self.length_hi) << 32);
+        }
+    };
+
+    pub const ProcX2apic = extern struct {
+        pub const enabled_flag = 0x1;
+
+        header: Entry,
+        reserved: u16 align(1),
+        domain: u32 align(1),
+        x2apic_id: u32 align(1),
+        flags: u32 align(1),
+        clock_domain: u32 align(1),
+        reserved_1: u32 align(1),
+
+        comptime {
+            std.debug.assert(@sizeOf(@This()) == 24);
+        }
+    };
+
+    header: SdtHeader,
+    reserved: u32,
+    reserved_1: u64 align(4),
+
+    _entries: Entry,
+
+    comptime {
+        std.debug.assert(@offsetOf(@This(), "_entries") == 48);
+    }
+
+    pub fn findByType(self: *Srat, begin: ?*Entry, ent_type: Entry.Type) ?*Entry {
+        var entry: *Entry = if (begin) |ent| blk: {
+            break :blk @ptrFromInt(@intFromPtr(ent) + ent.length);
+        } else &self._entries;
+
+        const end_addr = @intFromPtr(self) + self.header.length;
+
+        while (@intFromPtr(entry) < end_addr)
+        : (entry = @ptrFromInt(@intFromPtr(entry) + entry.length)) {
+            // Don`t trust hardware, avoid infinity loop
+            if (entry.length == 0) break;
+
+            if (entry.type == ent_type) return entry;
+        }
+
+        return null;
+    }
+};
+
+/// System Locality Information Table.
+/// Contains the relative distances between the proximity domains.
+pub const Slit = extern struct {
+    /// Distance from a domain to itself.
+    pub const local_distance = 10;
+    /// Distance used for the domains not described by the table.
+    pub const remote_distance = 20;
+
+    header: SdtHeader,
+    localities: u64 align(4),
+
+    _entries: u8,
+
+    /// Returns the relative distance between two proximity domains.
+    pub fn getDistance(self: *const Slit, from: u32, to: u32) u8 {
+        if (from >= self.localities or to >= self.localities) {
+            return if (from == to) local_distance else remote_distance;
+        }
+
+        const entries: [*]const u8 = @ptrCast(&self._entries);
+        return entries[@as(usize, from) * self.localities + to];
+    }
+};
+
 const mmio_size = 512 * utils.kb_size;
 
 var sdt: *Xsdt = undefined;
+var is_preinit = false;
+
+/// Provides early access to the ACPI tables through the linear memory access region.
+/// Can be used before the devices subsystem initialization, e.g. by the memory management.
+pub fn preinit() !void {
+    if (is_preinit) return;
+
+    sdt = @ptrFromInt(vm.getVirtLma(boot.getArchData().acpi_ptr));
+
+    if (!sdt.header.checkSum()) return error.XsdtChecksumFailed;
+
+    is_preinit = true;
+}
 
 pub fn init() !void {
     const phys = boot.getArchData().acpi_ptr;
@@ -57,9 +205,7 @@ pub fn init() !void {
     _ = io.request("ACPI Tables", phys, mmio_size, .mmio) orelse return error.MmioBusy;
     errdefer io.release(phys, .mmio);
 
-    sdt = @ptrFromInt(vm.getVirtLma(phys));
-
-    if (!sdt.header.checkSum()) return error.XsdtChecksumFailed;
+    try preinit();
 
     const fadt_hdr = findEntry("FACP") orelse return error.FadtNotFound;
     if (!fadt_hdr.checkSum()) return error.FadtChecksumFailed;
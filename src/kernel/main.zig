@@ -6,8 +6,10 @@
 
 const std = @import("std");
 const builtin = @import("builtin");
+const build_options = @import("build-options");
 
 const arch = utils.arch;
+const bench = @import("bench.zig");
 const boot = @import("boot.zig");
 const dev = @import("dev.zig");
 const logger = @import("logger.zig");
@@ -67,6 +69,8 @@ pub export fn main() noreturn {
 
     init(vfs);
     init(dev);
+
+    if (comptime build_options.bench) bench.run();
 }
 
 fn init(comptime Module: type) void {
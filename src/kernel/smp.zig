@@ -59,7 +59,15 @@ pub fn initCpu() void {
     const cpu_idx = Static.curr_cpu_idx;
     Static.curr_cpu_idx += 1;
 
+    // Local data must be available before any allocation,
+    // the page allocator uses it to access per-CPU lists.
+    const local_data = &cpus_data[cpu_idx];
+    local_data.idx = cpu_idx;
+
+    arch.setCpuLocalData(local_data);
+
     if (cpu_idx > 0) {
+        vm.PageAllocator.initCpu();
         arch.initCpu();
 
         vm.setPt(vm.getRootPt());
@@ -72,10 +80,6 @@ pub fn initCpu() void {
         vm.setPt(pt);
     }
 
-    const local_data = &cpus_data[cpu_idx];
-    local_data.idx = cpu_idx;
-
-    arch.setCpuLocalData(local_data);
     arch.setupCpu(cpu_idx);
 }
 
@@ -108,5 +112,12 @@ fn waitForInit() noreturn {
     init_lock.unlock();
 
     log.warn("CPU {} initialized", .{getIdx()});
-    utils.halt();
+
+    // Idle CPUs add the rest of memory while BSP continues the initialization.
+    vm.PageAllocator.initDeferred();
+
+    // Idle CPUs keep the pre-zeroed pools topped up, halted between the refills.
+    while (true) {
+        if (!vm.PageAllocator.fillZeroed()) vm.PageAllocator.waitZeroed();
+    }
 }
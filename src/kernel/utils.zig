@@ -51,11 +51,14 @@ pub const Heap = @import("utils/Heap.zig");
 pub const HashTable = hash_table.HashTable;
 pub const AutoHashTable = hash_table.AutoHashTable;
 pub const RefCount = @import("utils/ref-count.zig").RefCount;
+pub const RbTree = @import("utils/binary-tree.zig").RbTree;
 
 pub const byte_size = 8;
 pub const kb_size = 1024;
 pub const mb_size = kb_size * 1024;
 pub const gb_size = mb_size * 1024;
+/// Size of the CPU cache line in bytes.
+pub const cache_line_size = std.atomic.cache_line;
 
 pub inline fn alignUp(comptime T: type, value: T, alignment: T) T {
     return ((value + (alignment - 1)) & ~(alignment - 1));
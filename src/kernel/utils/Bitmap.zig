@@ -1,13 +1,25 @@
 //! # Bitmap
+//!
+//! Bits are numbered from the least significant bit of the first byte.
+//! Search is done on 64-bit words with `@ctz`/`@clz`, long uniform runs
+//! are skipped with vector compares.
 
 // Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
 
 const std = @import("std");
 
-const utils = @import("../utils.zig"); 
+const utils = @import("../utils.zig");
 
 const Self = @This();
 
+const Word = u64;
+const word_bytes = @sizeOf(Word);
+const word_bits = @bitSizeOf(Word);
+
+/// Number of bytes compared at once while skipping uniform runs.
+const vector_bytes = 32;
+const Vector = @Vector(vector_bytes, u8);
+
 bits: []u8 = &.{},
 
 pub inline fn init(bits: []u8, comptime is_setted: bool) Self {
@@ -34,43 +46,187 @@ pub inline fn toggle(self: *Self, bit_idx: usize) void {
     self.bits[bit_idx / utils.byte_size] ^= bitmask(bit_idx);
 }
 
-pub fn find(self: *Self, comptime is_setted: bool) ?usize {
-    const byte_val = if (is_setted) 0x00 else 0xFF;
+/// Sets `len` bits starting from `begin`.
+pub fn setRange(self: *Self, begin: usize, len: usize) void {
+    self.fillRange(begin, len, true);
+}
+
+/// Clears `len` bits starting from `begin`.
+pub fn clearRange(self: *Self, begin: usize, len: usize) void {
+    self.fillRange(begin, len, false);
+}
+
+/// Returns the index of the first bit with the value.
+pub fn find(self: *const Self, comptime is_setted: bool) ?usize {
+    return self.scan(0, is_setted);
+}
+
+/// Returns the index of the first bit with the value, starting from `begin`.
+pub fn findFrom(self: *const Self, begin: usize, comptime is_setted: bool) ?usize {
+    const byte_idx = begin / utils.byte_size;
+    if (byte_idx >= self.bits.len) return null;
+
+    // Bits before `begin` in the first byte are ignored
+    const head = (self.bits[byte_idx] ^ skipValue(u8, is_setted)) & ~(bitmask(begin) - 1);
+    if (head != 0) return byte_idx * utils.byte_size + @ctz(head);
+
+    return self.scan(byte_idx + 1, is_setted);
+}
 
-    for (0..self.bits.len) |byte_idx| {
-        const byte = self.bits[byte_idx];
+/// Returns the index of the last bit with the value.
+pub fn rfind(self: *const Self, comptime is_setted: bool) ?usize {
+    var end = self.bits.len;
 
-        if (byte == byte_val) continue;
+    // Bytes that don't form a whole word
+    while (end % word_bytes != 0) {
+        end -= 1;
 
-        for (0..utils.byte_size) |i| {
-            const is_curr_setted = (byte & bitmask(i)) != 0;
-            if (is_curr_setted == is_setted) return (byte_idx * utils.byte_size) + i;
-        }
+        const byte = self.bits[end] ^ skipValue(u8, is_setted);
+        if (byte != 0) return end * utils.byte_size + (utils.byte_size - 1 - @clz(byte));
+    }
+
+    while (end >= vector_bytes) : (end -= vector_bytes) {
+        if (!self.isUniform(end - vector_bytes, is_setted)) break;
+    }
+
+    while (end >= word_bytes) {
+        end -= word_bytes;
+
+        const word = self.loadWord(end) ^ skipValue(Word, is_setted);
+        if (word != 0) return end * utils.byte_size + (word_bits - 1 - @clz(word));
     }
 
     return null;
 }
 
-pub fn rfind(self: *Self, comptime is_setted: bool) ?usize {
-    const byte_val = if (is_setted) 0x00 else 0xFF;
-    var byte_idx = self.bits.len;
+/// Returns the index of the first run of `len` consecutive bits with the value.
+pub fn findRun(self: *const Self, len: usize, comptime is_setted: bool) ?usize {
+    std.debug.assert(len > 0);
 
-    while (byte_idx > 0) {
-        byte_idx -= 1;
+    const bits_num = self.bits.len * utils.byte_size;
+    var begin = self.scan(0, is_setted) orelse return null;
 
-        const byte = self.bits[byte_idx];
+    while (true) {
+        const end = self.findFrom(begin, !is_setted) orelse bits_num;
+        if (end - begin >= len) return begin;
 
-        if (byte == byte_val) continue;
+        begin = self.findFrom(end, is_setted) orelse return null;
+    }
+}
+
+/// Returns the index of the first bit with the value, starting from the byte `byte_begin`.
+fn scan(self: *const Self, byte_begin: usize, comptime is_setted: bool) ?usize {
+    var i = byte_begin;
+
+    while (i + vector_bytes <= self.bits.len) : (i += vector_bytes) {
+        if (!self.isUniform(i, is_setted)) break;
+    }
 
-        for (0..utils.byte_size) |i| {
-            const is_curr_setted = (byte & bitmask(i)) != 0;
-            if (is_curr_setted == is_setted) return (byte_idx * utils.byte_size) + i;
-        }
+    while (i + word_bytes <= self.bits.len) : (i += word_bytes) {
+        const word = self.loadWord(i) ^ skipValue(Word, is_setted);
+        if (word != 0) return i * utils.byte_size + @ctz(word);
+    }
+
+    while (i < self.bits.len) : (i += 1) {
+        const byte = self.bits[i] ^ skipValue(u8, is_setted);
+        if (byte != 0) return i * utils.byte_size + @ctz(byte);
     }
 
     return null;
 }
 
+fn fillRange(self: *Self, begin: usize, len: usize, comptime is_setted: bool) void {
+    var idx = begin;
+    const end = begin + len;
+
+    std.debug.assert(end <= self.bits.len * utils.byte_size);
+
+    // Head bits up to the byte boundary
+    while (idx < end and idx % utils.byte_size != 0) : (idx += 1) {
+        if (is_setted) self.set(idx) else self.clear(idx);
+    }
+
+    const bytes_end = end / utils.byte_size;
+
+    if (idx / utils.byte_size < bytes_end) {
+        @memset(self.bits[idx / utils.byte_size..bytes_end], if (is_setted) 0xFF else 0);
+        idx = bytes_end * utils.byte_size;
+    }
+
+    // Tail bits
+    while (idx < end) : (idx += 1) {
+        if (is_setted) self.set(idx) else self.clear(idx);
+    }
+}
+
+/// Checks if all bits in `vector_bytes` bytes starting from `byte_idx`
+/// have the opposite value to the searched one.
+inline fn isUniform(self: *const Self, byte_idx: usize, comptime is_setted: bool) bool {
+    const vec: Vector = self.bits[byte_idx..][0..vector_bytes].*;
+    return @reduce(.And, vec == @as(Vector, @splat(skipValue(u8, is_setted))));
+}
+
+inline fn loadWord(self: *const Self, byte_idx: usize) Word {
+    return std.mem.readInt(Word, self.bits[byte_idx..][0..word_bytes], .little);
+}
+
+/// Returns the value of the data unit without searched bits.
+inline fn skipValue(comptime T: type, comptime is_setted: bool) T {
+    return if (is_setted) 0 else std.math.maxInt(T);
+}
+
 inline fn bitmask(bit_idx: usize) u8 {
     return @as(u8,1) << @truncate(@mod(bit_idx, utils.byte_size));
-}
\ No newline at end of file
+}
+
+test "find" {
+    var bits: [100]u8 = undefined;
+    var bitmap = Self.init(&bits, true);
+
+    try std.testing.expect(bitmap.find(false) == null);
+    try std.testing.expect(bitmap.rfind(false) == null);
+
+    bitmap.clear(3);
+    bitmap.clear(517);
+    bitmap.clear(795);
+
+    try std.testing.expect(bitmap.find(false) == 3);
+    try std.testing.expect(bitmap.findFrom(4, false) == 517);
+    try std.testing.expect(bitmap.findFrom(518, false) == 795);
+    try std.testing.expect(bitmap.rfind(false) == 795);
+    try std.testing.expect(bitmap.find(true) == 0);
+    try std.testing.expect(bitmap.rfind(true) == 799);
+}
+
+test "range" {
+    var bits: [100]u8 = undefined;
+    var bitmap = Self.init(&bits, false);
+
+    bitmap.setRange(5, 300);
+
+    try std.testing.expect(bitmap.find(true) == 5);
+    try std.testing.expect(bitmap.rfind(true) == 304);
+    try std.testing.expect(bitmap.findFrom(5, false) == 305);
+
+    bitmap.clearRange(6, 298);
+
+    try std.testing.expect(bitmap.findFrom(6, true) == 304);
+    try std.testing.expect(bitmap.get(5) != 0 and bitmap.get(6) == 0 and bitmap.get(303) == 0);
+}
+
+test "find run" {
+    var bits: [100]u8 = undefined;
+    var bitmap = Self.init(&bits, true);
+
+    bitmap.clearRange(10, 4);
+    bitmap.clearRange(100, 40);
+    bitmap.clearRange(700, 100);
+
+    try std.testing.expect(bitmap.findRun(1, false) == 10);
+    try std.testing.expect(bitmap.findRun(4, false) == 10);
+    try std.testing.expect(bitmap.findRun(5, false) == 100);
+    try std.testing.expect(bitmap.findRun(41, false) == 700);
+    try std.testing.expect(bitmap.findRun(100, false) == 700);
+    try std.testing.expect(bitmap.findRun(101, false) == null);
+    try std.testing.expect(bitmap.findRun(10, true) == 0);
+}
@@ -1,4 +1,9 @@
 //! # Heap
+//!
+//! Allocates ranges of virtual pages growing from the `base`.
+//! Released ranges are coalesced with their free neighbours and kept
+//! in two red-black trees: by address (to find neighbours) and by size
+//! (to find the best fit). Both reserve and release are O(log n).
 
 // Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
 
@@ -8,7 +13,7 @@ const utils = @import("../utils.zig");
 const vm = @import("../vm.zig");
 
 const Self = @This();
-const List_t = utils.SList(Range);
+
 const Range = struct {
     base: usize = undefined,
     pages: u32 = undefined,
@@ -16,117 +21,139 @@ const Range = struct {
     pub inline fn top(self: *const Range) usize {
         return self.base + (self.pages * vm.page_size);
     }
+
+    fn cmpBase(lhs: *const Range, rhs: *const Range) utils.CmpResult {
+        if (lhs.base == rhs.base) { return .equals; }
+        else if (lhs.base < rhs.base) { return .less; }
+
+        return .great;
+    }
+
+    /// Orders ranges by size, ranges of the same size by address.
+    fn cmpSize(lhs: *const *const Range, rhs: *const *const Range) utils.CmpResult {
+        if (lhs.*.pages != rhs.*.pages) return if (lhs.*.pages < rhs.*.pages) .less else .great;
+        return cmpBase(lhs.*, rhs.*);
+    }
+};
+
+const AddrTree = utils.RbTree(Range, Range.cmpBase);
+const SizeTree = utils.RbTree(*const Range, Range.cmpSize);
+
+/// Free range linked into both trees.
+const FreeRange = struct {
+    by_addr: AddrTree.Node,
+    by_size: SizeTree.Node,
+
+    inline fn fromSize(node: *SizeTree.Node) *FreeRange {
+        return @fieldParentPtr("by_size", node);
+    }
+
+    inline fn fromAddr(node: *AddrTree.Node) *FreeRange {
+        return @fieldParentPtr("by_addr", node);
+    }
 };
 
 base: usize = undefined,
 top: usize = undefined,
 
-free_list: List_t = undefined,
+free_by_addr: AddrTree = .{},
+free_by_size: SizeTree = .{},
 
-var nodes_oma = vm.ObjectAllocator.initSized(@sizeOf(List_t.Node), 1);
+var nodes_oma = vm.ObjectAllocator.initSized(@sizeOf(FreeRange), 1);
 
 pub inline fn init(base: usize) Self {
     return Self{ .base = base, .top = base };
 }
 
+/// Reserves the smallest free range that fits the pages,
+/// or grows the heap if there is no one.
 pub fn reserve(self: *Self, pages: u32) usize {
     std.debug.assert(pages > 0);
 
-    var result: usize = undefined;
-    var suitable_range: ?*List_t.Node = null;
+    const key = Range{ .base = 0, .pages = pages };
+    const key_ptr: *const Range = &key;
 
-    if (self.free_list.first != null) {
-        var curr_range = self.free_list.first;
+    const size_node = self.free_by_size.findCeil(&key_ptr) orelse {
+        const result = self.top;
+        self.top += pages * vm.page_size;
 
-        while (curr_range) |range| : (curr_range = range.next) {
-            if (range.data.pages >= pages and
-                (suitable_range == null or
-                (suitable_range != null and suitable_range.?.data.pages < range.data.pages)))
-            {
-                suitable_range = range;
+        return result;
+    };
 
-                if (range.data.pages == pages) break;
-            }
-        }
+    const range = FreeRange.fromSize(size_node);
+    const result = range.by_addr.data.base;
 
-        if (suitable_range) |range| {
-            result = range.data.base;
-            self.removeRange(range, pages);
-        }
-    }
+    self.free_by_size.removeNode(size_node);
 
-    if (suitable_range == null) {
-        result = self.top;
-        self.top += pages * vm.page_size;
+    if (range.by_addr.data.pages > pages) {
+        range.by_addr.data.base += pages * vm.page_size;
+        range.by_addr.data.pages -= pages;
+
+        self.free_by_size.insert(size_node);
+    } else {
+        self.free_by_addr.removeNode(&range.by_addr);
+        nodes_oma.free(range);
     }
 
     return result;
 }
 
+/// Releases the range, coalescing it with the free neighbours.
 pub fn release(self: *Self, base: usize, pages: u32) void {
     std.debug.assert(base > 0 and pages > 0);
 
     const range_top = base + (pages * vm.page_size);
+    const key = Range{ .base = base };
+
+    const prev = self.free_by_addr.findFloor(key);
+    const next = self.free_by_addr.findCeil(key);
+
+    const prev_range: ?*FreeRange = if (prev != null and prev.?.data.top() == base) FreeRange.fromAddr(prev.?) else null;
+    const next_range: ?*FreeRange = if (next != null and next.?.data.base == range_top) FreeRange.fromAddr(next.?) else null;
 
     if (range_top == self.top) {
         self.top = base;
-        return;
-    }
-
-    var curr_range = self.free_list.first;
 
-    while (curr_range) |range| : (curr_range = range.next) {
-        if (range.data.base == range_top) {
-            range.data.base = base;
-            range.data.pages += pages;
-            break;
-        } else if (range.data.top() == base) {
-            range.data.pages += pages;
-            break;
+        // The previous free range is on the top now
+        if (prev_range) |range| {
+            self.top = range.by_addr.data.base;
+            self.deleteRange(range);
         }
-    }
 
-    if (curr_range == null) {
-        const range = nodes_oma.alloc(List_t.Node) orelse unreachable;
-        range.data.base = base;
-        range.data.pages = pages;
+        return;
+    }
 
-        self.free_list.prepend(range);
-    } else {
-        var target_node = curr_range.?;
-        curr_range = self.free_list.first;
+    if (prev_range) |range| {
+        self.free_by_size.removeNode(&range.by_size);
+        range.by_addr.data.pages += pages;
 
-        const target_top = target_node.data.top();
+        if (next_range) |next_free| {
+            range.by_addr.data.pages += next_free.by_addr.data.pages;
+            self.deleteRange(next_free);
+        }
 
-        while (curr_range) |range| : (curr_range = range.next) {
-            if (curr_range == target_node) continue;
+        self.free_by_size.insert(&range.by_size);
+    } else if (next_range) |range| {
+        self.free_by_size.removeNode(&range.by_size);
 
-            const curr_range_top = range.data.top();
+        range.by_addr.data.base = base;
+        range.by_addr.data.pages += pages;
 
-            if (range.data.base == target_top) {
-                range.data.base = target_node.data.base;
-                range.data.pages += target_node.data.pages;
+        self.free_by_size.insert(&range.by_size);
+    } else {
+        const range = nodes_oma.alloc(FreeRange) orelse unreachable;
 
-                self.free_list.remove(target_node);
-                nodes_oma.free(target_node);
-                break;
-            } else if (curr_range_top == target_node.data.base) {
-                range.data.pages += target_node.data.pages;
+        range.by_addr = AddrTree.Node.init(.{ .base = base, .pages = pages });
+        range.by_size = SizeTree.Node.init(&range.by_addr.data);
 
-                self.free_list.remove(target_node);
-                nodes_oma.free(target_node);
-                break;
-            }
-        }
+        self.free_by_addr.insert(&range.by_addr);
+        self.free_by_size.insert(&range.by_size);
     }
 }
 
-inline fn removeRange(self: *Self, node: *List_t.Node, pages: u32) void {
-    if (node.data.pages > pages) {
-        node.data.base += pages * vm.page_size;
-        node.data.pages -= pages;
-    } else {
-        self.free_list.remove(node);
-        nodes_oma.free(node);
-    }
+inline fn deleteRange(self: *Self, range: *FreeRange) void {
+    self.free_by_addr.removeNode(&range.by_addr);
+    self.free_by_size.removeNode(&range.by_size);
+
+    nodes_oma.free(range);
 }
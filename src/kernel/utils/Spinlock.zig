@@ -38,6 +38,16 @@ pub inline fn lock(self: *Self) void {
     ) != null) {}
 }
 
+/// Attempts to acquire the lock without spinning.
+///
+/// - Returns `true` if the lock was acquired, `false` if it is already locked.
+pub inline fn tryLock(self: *Self) bool {
+    return self.exclusion.cmpxchgStrong(
+        @intFromEnum(State.unlocked), @intFromEnum(State.locked),
+        .acquire, .monotonic
+    ) == null;
+}
+
 /// Releases the lock, making it available for others threads to acquire.
 pub inline fn unlock(self: *Self) void {
     self.exclusion.store(@intFromEnum(State.unlocked), .release);
@@ -1,4 +1,6 @@
 //! # Binary tree implementation
+//!
+//! Provides an unbalanced `BinaryTree` and a self-balancing red-black `RbTree`.
 
 // Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
 
@@ -181,14 +183,14 @@ pub fn BinaryTree(comptime T: type, comptime cmp_func: ?utils.CmpFnType(T)) type
             const err_str = "Only raw values or pointers to data member type allowed";
 
             switch (type_info) {
-                .Pointer => |ptr| {
+                .pointer => |ptr| {
                     if (ptr.child != T) @compileError(err_str);
                     return func(self, val);
                 },
-                .ComptimeInt,
-                .ComptimeFloat => switch (@typeInfo(T)) {
-                    .Int,
-                    .Float => {
+                .comptime_int,
+                .comptime_float => switch (@typeInfo(T)) {
+                    .int,
+                    .float => {
                         const value = @as(T, val);
                         return func(self, &value);
                     },
@@ -283,6 +285,456 @@ pub fn BinaryTree(comptime T: type, comptime cmp_func: ?utils.CmpFnType(T)) type
     };
 }
 
+/// Red-black tree data structure for managing elements of type `T`.
+/// Keeps the tree balanced on insertion and removal, so lookup, insert
+/// and remove are guaranteed to be O(log n), regardless of the insertion order.
+/// 
+/// - `T`: The type of data stored in the tree nodes.
+/// - `cmp_func`: An optional comparison function for ordering the elements in the tree. 
+///   If `null`, a default comparison function is used.
+/// - Returns: A red-black tree type.
+pub fn RbTree(comptime T: type, comptime cmp_func: ?utils.CmpFnType(T)) type {
+    const cmpFn = cmp_func orelse defaultCmpFn(T);
+
+    return struct {
+        const Self = @This();
+
+        pub const Color = enum(u1) {
+            red,
+            black
+        };
+
+        /// Represents a node in the red-black tree.
+        pub const Node = struct {
+            lhs: ?*Node = null,
+            rhs: ?*Node = null,
+            parent: ?*Node = null,
+            color: Color = .red,
+
+            data: T,
+
+            /// Initializes a new node with the given value.
+            pub inline fn init(val: T) Node {
+                return Node{ .data = val };
+            }
+
+            /// Finds the node with the minimum value in the subtree rooted at this node.
+            pub inline fn findMin(self: *Node) *Node {
+                var it = self;
+
+                while (it.lhs) |lhs| { it = lhs; }
+
+                return it;
+            }
+
+            /// Finds the node with the maximum value in the subtree rooted at this node.
+            pub inline fn findMax(self: *Node) *Node {
+                var it = self;
+
+                while (it.rhs) |rhs| { it = rhs; }
+
+                return it;
+            }
+
+            /// Returns the node with the next value in the ascending order.
+            pub fn next(self: *Node) ?*Node {
+                if (self.rhs) |rhs| return rhs.findMin();
+
+                var it = self;
+                while (it.parent) |parent| : (it = parent) {
+                    if (parent.lhs == it) return parent;
+                }
+
+                return null;
+            }
+
+            inline fn isRed(node: ?*const Node) bool {
+                return if (node) |n| n.color == .red else false;
+            }
+        };
+
+        /// The root node of the tree.
+        root: ?*Node = null,
+
+        /// Inserts a new node into the tree, maintaining the tree's order and balance.
+        /// 
+        /// - `node`: A pointer to the node to insert.
+        pub fn insert(self: *Self, node: *Node) void {
+            var parent: ?*Node = null;
+            var it = self.root;
+
+            while (it) |curr| {
+                parent = curr;
+                it = if (cmpFn(&curr.data, &node.data) == .less) curr.rhs else curr.lhs;
+            }
+
+            node.lhs = null;
+            node.rhs = null;
+            node.parent = parent;
+            node.color = .red;
+
+            if (parent) |par| {
+                if (cmpFn(&par.data, &node.data) == .less) { par.rhs = node; }
+                else { par.lhs = node; }
+            } else {
+                self.root = node;
+            }
+
+            self.fixInsert(node);
+        }
+
+        /// Removes a node with a value equal to `val` from the tree.
+        /// 
+        /// - `val`: The value of the node to remove (can be a raw value or a pointer).
+        /// - Returns: The removed node, or `null` if no node with the specified value was found.
+        pub inline fn remove(self: *Self, val: anytype) ?*Node {
+            return anytype_call(@TypeOf(self), removeImpl, self, val);
+        }
+
+        /// Removes the node from the tree.
+        /// 
+        /// - `node`: A pointer to the node in the tree.
+        pub fn removeNode(self: *Self, node: *Node) void {
+            var removed_color = node.color;
+            var child: ?*Node = undefined;
+            var child_parent: ?*Node = undefined;
+
+            if (node.lhs == null) {
+                child = node.rhs;
+                child_parent = node.parent;
+                self.transplant(node, node.rhs);
+            } else if (node.rhs == null) {
+                child = node.lhs;
+                child_parent = node.parent;
+                self.transplant(node, node.lhs);
+            } else {
+                // Replace the node with it's successor
+                const next = node.rhs.?.findMin();
+
+                removed_color = next.color;
+                child = next.rhs;
+
+                if (next.parent == node) {
+                    child_parent = next;
+                } else {
+                    child_parent = next.parent;
+                    self.transplant(next, next.rhs);
+
+                    next.rhs = node.rhs;
+                    next.rhs.?.parent = next;
+                }
+
+                self.transplant(node, next);
+
+                next.lhs = node.lhs;
+                next.lhs.?.parent = next;
+                next.color = node.color;
+            }
+
+            if (removed_color == .black) self.fixRemove(child, child_parent);
+
+            node.lhs = null;
+            node.rhs = null;
+            node.parent = null;
+        }
+
+        /// Finds a node with a value equal to `val` in the tree.
+        /// 
+        /// - `val`: The value to search for (can be a raw value or a pointer).
+        /// - Returns: A pointer to the found node, or `null` if no node with the specified value was found.
+        pub inline fn find(self: *const Self, val: anytype) ?*Node {
+            return anytype_call(@TypeOf(self), findImpl, self, val);
+        }
+
+        /// Finds the node with the maximum value in the entire tree.
+        /// 
+        /// - Returns: A pointer to the node with the maximum value, or `null` if the tree is empty.
+        pub inline fn findMax(self: *const Self) ?*Node {
+            const root = self.root orelse return null;
+            return root.findMax();
+        }
+
+        /// Finds the node with the minimum value in the entire tree.
+        /// 
+        /// - Returns: A pointer to the node with the minimum value, or `null` if the tree is empty.
+        pub inline fn findMin(self: *const Self) ?*Node {
+            const root = self.root orelse return null;
+            return root.findMin();
+        }
+
+        /// Finds the node with the smallest value greater than or equal to `val`.
+        /// 
+        /// - `val`: The value to search for (can be a raw value or a pointer).
+        /// - Returns: A pointer to the found node, or `null` if all values are less than `val`.
+        pub inline fn findCeil(self: *const Self, val: anytype) ?*Node {
+            return anytype_call(@TypeOf(self), findCeilImpl, self, val);
+        }
+
+        /// Finds the node with the largest value less than or equal to `val`.
+        /// 
+        /// - `val`: The value to search for (can be a raw value or a pointer).
+        /// - Returns: A pointer to the found node, or `null` if all values are greater than `val`.
+        pub inline fn findFloor(self: *const Self, val: anytype) ?*Node {
+            return anytype_call(@TypeOf(self), findFloorImpl, self, val);
+        }
+
+        /// A helper function that handles different types of inputs (`raw values` or `pointers`)
+        /// and calls the appropriate method with a pointer to the value.
+        inline fn anytype_call(comptime SelfPtr: type, comptime func: anytype, self: SelfPtr, val: anytype) ?*Node {
+            const type_info = @typeInfo(@TypeOf(val));
+            const err_str = "Only raw values or pointers to data member type allowed";
+
+            switch (type_info) {
+                .pointer => |ptr| {
+                    if (ptr.child != T) @compileError(err_str);
+                    return func(self, val);
+                },
+                .comptime_int,
+                .comptime_float => switch (@typeInfo(T)) {
+                    .int,
+                    .float => {
+                        const value = @as(T, val);
+                        return func(self, &value);
+                    },
+                    else => @compileError(err_str)
+                },
+                else => {
+                    if (T == @TypeOf(val)) { return func(self, &val); }
+                    else { @compileError(err_str); }
+                }
+            }
+        }
+
+        fn findCeilImpl(self: *const Self, val: *const T) ?*Node {
+            var result: ?*Node = null;
+            var it: ?*Node = self.root;
+
+            while (it) |node| {
+                switch (cmpFn(&node.data, val)) {
+                    .equals => return node,
+                    .less => it = node.rhs,
+                    .great => {
+                        result = node;
+                        it = node.lhs;
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        fn findFloorImpl(self: *const Self, val: *const T) ?*Node {
+            var result: ?*Node = null;
+            var it: ?*Node = self.root;
+
+            while (it) |node| {
+                switch (cmpFn(&node.data, val)) {
+                    .equals => return node,
+                    .great => it = node.lhs,
+                    .less => {
+                        result = node;
+                        it = node.rhs;
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        fn removeImpl(self: *Self, val: *const T) ?*Node {
+            const node = self.findImpl(val) orelse return null;
+            self.removeNode(node);
+
+            return node;
+        }
+
+        fn findImpl(self: *const Self, val: *const T) ?*Node {
+            var it: ?*Node = self.root;
+
+            while (it) |node| {
+                const cmp = cmpFn(&node.data, val);
+
+                if (cmp == .equals) { return node; }
+                else if (cmp == .less) {
+                    it = node.rhs;
+                }
+                else {
+                    it = node.lhs;
+                }
+            }
+
+            return null;
+        }
+
+        /// Restores the red-black properties after insertion of the red `node`.
+        fn fixInsert(self: *Self, node: *Node) void {
+            var it = node;
+
+            while (it.parent) |parent| {
+                if (parent.color == .black) break;
+
+                // Red node is never the root, so the grandparent exists.
+                const grand = parent.parent.?;
+
+                if (parent == grand.lhs) {
+                    const uncle = grand.rhs;
+
+                    if (Node.isRed(uncle)) {
+                        parent.color = .black;
+                        uncle.?.color = .black;
+                        grand.color = .red;
+                        it = grand;
+                        continue;
+                    }
+
+                    if (it == parent.rhs) {
+                        it = parent;
+                        self.rotateLeft(it);
+                    }
+
+                    it.parent.?.color = .black;
+                    grand.color = .red;
+                    self.rotateRight(grand);
+                } else {
+                    const uncle = grand.lhs;
+
+                    if (Node.isRed(uncle)) {
+                        parent.color = .black;
+                        uncle.?.color = .black;
+                        grand.color = .red;
+                        it = grand;
+                        continue;
+                    }
+
+                    if (it == parent.lhs) {
+                        it = parent;
+                        self.rotateRight(it);
+                    }
+
+                    it.parent.?.color = .black;
+                    grand.color = .red;
+                    self.rotateLeft(grand);
+                }
+            }
+
+            self.root.?.color = .black;
+        }
+
+        /// Restores the red-black properties after removal of a black node.
+        /// 
+        /// - `node`: The node that took place of the removed one, may be `null`.
+        /// - `node_parent`: Parent of the `node`.
+        fn fixRemove(self: *Self, node: ?*Node, node_parent: ?*Node) void {
+            var it = node;
+            var parent = node_parent;
+
+            while (it != self.root and !Node.isRed(it)) {
+                const par = parent.?;
+
+                if (it == par.lhs) {
+                    var sibling = par.rhs.?;
+
+                    if (sibling.color == .red) {
+                        sibling.color = .black;
+                        par.color = .red;
+                        self.rotateLeft(par);
+                        sibling = par.rhs.?;
+                    }
+
+                    if (!Node.isRed(sibling.lhs) and !Node.isRed(sibling.rhs)) {
+                        sibling.color = .red;
+                        it = par;
+                        parent = par.parent;
+                        continue;
+                    }
+
+                    if (!Node.isRed(sibling.rhs)) {
+                        sibling.lhs.?.color = .black;
+                        sibling.color = .red;
+                        self.rotateRight(sibling);
+                        sibling = par.rhs.?;
+                    }
+
+                    sibling.color = par.color;
+                    par.color = .black;
+                    sibling.rhs.?.color = .black;
+                    self.rotateLeft(par);
+                } else {
+                    var sibling = par.lhs.?;
+
+                    if (sibling.color == .red) {
+                        sibling.color = .black;
+                        par.color = .red;
+                        self.rotateRight(par);
+                        sibling = par.lhs.?;
+                    }
+
+                    if (!Node.isRed(sibling.lhs) and !Node.isRed(sibling.rhs)) {
+                        sibling.color = .red;
+                        it = par;
+                        parent = par.parent;
+                        continue;
+                    }
+
+                    if (!Node.isRed(sibling.lhs)) {
+                        sibling.rhs.?.color = .black;
+                        sibling.color = .red;
+                        self.rotateLeft(sibling);
+                        sibling = par.lhs.?;
+                    }
+
+                    sibling.color = par.color;
+                    par.color = .black;
+                    sibling.lhs.?.color = .black;
+                    self.rotateRight(par);
+                }
+
+                it = self.root;
+                break;
+            }
+
+            if (it) |n| n.color = .black;
+        }
+
+        fn rotateLeft(self: *Self, node: *Node) void {
+            const rhs = node.rhs.?;
+
+            node.rhs = rhs.lhs;
+            if (rhs.lhs) |lhs| lhs.parent = node;
+
+            self.transplant(node, rhs);
+
+            rhs.lhs = node;
+            node.parent = rhs;
+        }
+
+        fn rotateRight(self: *Self, node: *Node) void {
+            const lhs = node.lhs.?;
+
+            node.lhs = lhs.rhs;
+            if (lhs.rhs) |rhs| rhs.parent = node;
+
+            self.transplant(node, lhs);
+
+            lhs.rhs = node;
+            node.parent = lhs;
+        }
+
+        /// Replaces the subtree rooted at `old` with the subtree rooted at `new`
+        /// in the parent of `old`.
+        inline fn transplant(self: *Self, old: *Node, new: ?*Node) void {
+            if (old.parent) |parent| {
+                if (parent.lhs == old) { parent.lhs = new; }
+                else { parent.rhs = new; }
+            } else {
+                self.root = new;
+            }
+
+            if (new) |n| n.parent = old.parent;
+        }
+    };
+}
+
 const Test = struct {
     pub const BtType = BinaryTree(u32, null);
     const Node = BtType.Node;
@@ -395,3 +847,129 @@ test "remove" {
     try std.testing.expect(tree.remove(60) != null);
     try std.testing.expect(tree.remove(60) == null);
 }
+
+const RbTest = struct {
+    pub const RbType = RbTree(u32, null);
+    const Node = RbType.Node;
+
+    pub const nodes_num = 256;
+
+    pub var nodes: [nodes_num]Node = undefined;
+
+    /// Inserts all nodes in ascending order, the worst case for unbalanced tree.
+    pub fn tree() RbType {
+        var res = RbType{};
+
+        for (&nodes, 0..) |*node, i| {
+            node.* = Node.init(@truncate(i));
+            res.insert(node);
+        }
+
+        return res;
+    }
+
+    /// Checks the red-black properties of the subtree.
+    /// 
+    /// - Returns: The black height of the subtree.
+    pub fn check(node: ?*Node) !u32 {
+        const n = node orelse return 1;
+
+        if (n.color == .red) {
+            try std.testing.expect(!Node.isRed(n.lhs) and !Node.isRed(n.rhs));
+        }
+        if (n.lhs) |lhs| {
+            try std.testing.expect(lhs.parent == n and lhs.data < n.data);
+        }
+        if (n.rhs) |rhs| {
+            try std.testing.expect(rhs.parent == n and rhs.data > n.data);
+        }
+
+        const lhs_height = try check(n.lhs);
+        const rhs_height = try check(n.rhs);
+
+        try std.testing.expect(lhs_height == rhs_height);
+
+        return lhs_height + @intFromBool(n.color == .black);
+    }
+
+    pub fn depth(node: ?*Node) u32 {
+        const n = node orelse return 0;
+        return 1 + @max(depth(n.lhs), depth(n.rhs));
+    }
+};
+
+test "rb insert" {
+    const tree = RbTest.tree();
+
+    try std.testing.expect(tree.root.?.color == .black);
+    _ = try RbTest.check(tree.root);
+
+    // Height of the red-black tree is at most 2 * log2(n + 1)
+    try std.testing.expect(RbTest.depth(tree.root) <= 2 * std.math.log2_int_ceil(u32, RbTest.nodes_num + 1));
+}
+
+test "rb find" {
+    const tree = RbTest.tree();
+
+    for (&RbTest.nodes, 0..) |*node, i| {
+        try std.testing.expect(tree.find(@as(u32, @truncate(i))) == node);
+    }
+
+    try std.testing.expect(tree.find(RbTest.nodes_num) == null);
+    try std.testing.expect(tree.findMin() == &RbTest.nodes[0]);
+    try std.testing.expect(tree.findMax() == &RbTest.nodes[RbTest.nodes_num - 1]);
+}
+
+test "rb find ceil/floor" {
+    var tree = RbTest.tree();
+
+    _ = tree.remove(10);
+    _ = tree.remove(11);
+
+    try std.testing.expect(tree.findCeil(10) == &RbTest.nodes[12]);
+    try std.testing.expect(tree.findFloor(11) == &RbTest.nodes[9]);
+    try std.testing.expect(tree.findCeil(12) == &RbTest.nodes[12]);
+    try std.testing.expect(tree.findFloor(12) == &RbTest.nodes[12]);
+    try std.testing.expect(tree.findCeil(RbTest.nodes_num) == null);
+    try std.testing.expect(tree.findFloor(0) == &RbTest.nodes[0]);
+}
+
+test "rb next" {
+    var tree = RbTest.tree();
+
+    _ = tree.remove(100);
+
+    var node = tree.findMin();
+    var count: u32 = 0;
+
+    while (node) |n| : (node = n.next()) {
+        try std.testing.expect(n.data == count + @intFromBool(count >= 100));
+        count += 1;
+    }
+
+    try std.testing.expect(count == RbTest.nodes_num - 1);
+}
+
+test "rb remove" {
+    var tree = RbTest.tree();
+
+    // Remove even values
+    var i: u32 = 0;
+    while (i < RbTest.nodes_num) : (i += 2) {
+        try std.testing.expect(tree.remove(i) == &RbTest.nodes[i]);
+        _ = try RbTest.check(tree.root);
+    }
+
+    try std.testing.expect(tree.remove(@as(u32, 0)) == null);
+    try std.testing.expect(tree.find(@as(u32, 1)) == &RbTest.nodes[1]);
+    try std.testing.expect(tree.find(@as(u32, 2)) == null);
+
+    // Remove the rest
+    i = 1;
+    while (i < RbTest.nodes_num) : (i += 2) {
+        try std.testing.expect(tree.remove(i) == &RbTest.nodes[i]);
+        _ = try RbTest.check(tree.root);
+    }
+
+    try std.testing.expect(tree.root == null);
+}
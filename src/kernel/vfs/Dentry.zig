@@ -98,7 +98,9 @@ child: List = .{},
 ref_count: utils.RefCount(u32) = .{},
 lock: utils.Spinlock = .{},
 
-pub var oma = vm.SafeOma(lookup_cache.Entry).init(oma_capacity);
+pub var oma = vm.SafeOma(lookup_cache.Entry).initEx(oma_capacity, .{
+    .alignment = utils.cache_line_size, .colouring = true
+});
 
 pub inline fn new() ?*Dentry {
     const dentry = &(oma.alloc() orelse return null).data.value.data;
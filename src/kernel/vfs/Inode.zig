@@ -38,7 +38,9 @@ ref_count: utils.RefCount(u32) = .{},
 
 fs_data: utils.AnyData = .{},
 
-pub var oma = vm.SafeOma(Inode).init(oma_capacity);
+pub var oma = vm.SafeOma(Inode).initEx(oma_capacity, .{
+    .alignment = utils.cache_line_size, .colouring = true
+});
 
 pub inline fn new() ?*Inode {
     const inode = oma.alloc() orelse return null;
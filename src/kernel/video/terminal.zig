@@ -85,8 +85,12 @@ var char_buf_rank: u32 = undefined;
 var color_buffer: []u32 = undefined;
 var color_buf_rank: u32 = undefined;
 
+/// Framebuffer mapping flags, writes are combined into bursts.
+pub const fb_map_flags = vm.MapFlags{ .write = true, .global = true, .large = true, .write_combining = true };
+
 pub fn init() !void {
     boot.getFb(&framebuffer);
+    try boot.remapFb(fb_map_flags);
 
     try text_output.init(&framebuffer);
     errdefer text_output.deinit();
@@ -129,6 +133,20 @@ pub fn deinit() void {
     vm.PageAllocator.free(@intFromPtr(color_buf_phys), color_buf_rank);
 }
 
+/// Redraws all characters of the screen from the buffers.
+pub fn redraw() void {
+    if (comptime use_buffers == false) return;
+
+    for (0..rows) |row| {
+        for (0..cols) |col| {
+            const idx = (row * cols) + col;
+            const char = if (char_buffer[idx] == 0) ' ' else char_buffer[idx];
+
+            text_output.drawChar(char, color_buffer[idx], @truncate(row), @truncate(col));
+        }
+    }
+}
+
 /// Sets the cursor position to the specified row and column.
 pub inline fn setCursor(row: u16, col: u16) void {
     cursor.row = row % rows;
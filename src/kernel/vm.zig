@@ -10,6 +10,7 @@ const std = @import("std");
 
 const arch = @import("utils.zig").arch;
 const boot = @import("boot.zig");
+const log = std.log.scoped(.vm);
 const utils = @import("utils.zig");
 
 /// The size of a memory page, specific to the architecture.
@@ -33,47 +34,15 @@ pub const cache = @import("vm/cache.zig");
 pub const Heap = utils.Heap;
 pub const ObjectAllocator = @import("vm/ObjectAllocator.zig");
 pub const PageAllocator = @import("vm/PageAllocator.zig");
+pub const SafeOma = @import("vm/safe-oma.zig").SafeOma;
 pub const UniversalAllocator = @import("vm/UniversalAllocator.zig");
 
-/// Thread-safe Object memory allocator wrapper.
-/// Combination of the `ObjectAllocator` and `Spinlock`.
-pub fn SafeOma(comptime T: type) type {
-    return struct {
-        const Self = @This();
-
-        oma: ObjectAllocator = ObjectAllocator.init(T),
-        lock: utils.Spinlock = utils.Spinlock.init(.unlocked),
-
-        pub inline fn alloc(self: *Self) ?*T {
-            self.lock.lock();
-            defer self.lock.unlock();
-
-            return self.oma.alloc(T);
-        }
-
-        pub inline fn free(self: *Self, obj_ptr: *anyopaque) void {
-            self.lock.lock();
-            defer self.lock.unlock();
-
-            self.oma.free(obj_ptr);
-        }
-
-        pub inline fn init(comptime capacity: usize) Self {
-            return .{
-                .oma = ObjectAllocator.initCapacity(@sizeOf(T), capacity)
-            };
-        }
-
-        pub inline fn deinit(self: *Self) void {
-            self.oma.deinit();
-        }
-    };
-}
-
 /// Allocates a new page table and zeroing all entries.
 pub const allocPt = arch.vm.allocPt;
 /// Frees a page table.
 pub const freePt = arch.vm.freePt;
+/// Fills pages with zeros bypassing the cache if possible.
+pub const zeroPages = arch.vm.zeroPages;
 /// Gets the current page table from the specific cpu register.
 pub const getPt = arch.vm.getPt;
 /// Sets the given page table to the specific cpu register.
@@ -90,6 +59,17 @@ pub const logPt = arch.vm.logPt;
 /// - `page_table`: target page table.
 pub const mmap = arch.vm.mmap;
 
+/// Unmaps a virtual memory range, frees page tables left empty
+/// and invalidates the TLB entries of the range on all CPUs.
+/// 
+/// - `virt`: base virtual address of the range.
+/// - `pages`: number of pages to unmap.
+/// - `page_table`: target page table.
+pub const unmap = arch.vm.unmap;
+/// Invalidates the TLB entries of the virtual memory range on all CPUs.
+/// Must be called with interrupts enabled and not from an interrupt handler.
+pub const flushTlb = arch.vm.flushTlb;
+
 /// General-purpose kernel memory allocation function.
 pub const malloc = UniversalAllocator.alloc;
 /// General-purpose kernel memory deallocation function.
@@ -98,7 +78,7 @@ pub const free = UniversalAllocator.free;
 /// General-purpose kernel allocation function to allocate
 /// object of the specific type.
 pub inline fn alloc(comptime T: type) ?*T {
-    return @alignCast(@ptrCast(malloc(@sizeOf(T))));
+    return @alignCast(@ptrCast(UniversalAllocator.allocAligned(@sizeOf(T), @alignOf(T))));
 }
 
 /// Kernel high-level general purpose allocator interface.
@@ -117,7 +97,10 @@ const std_vtable = opaque {
     };
 
     fn stdAlloc(_: *anyopaque, len: usize, ptr_align: u8, _: usize) ?[*]u8 {
-        const result = malloc(len) orelse return null;
+        const alignment = @as(usize, 1) << @truncate(ptr_align);
+        if (alignment > page_size) return null;
+
+        const result = UniversalAllocator.allocAligned(len, alignment) orelse return null;
         // Check if pointer is aligned
         std.debug.assert((@intFromPtr(result) % (@as(u32, 1) << @truncate(ptr_align))) == 0);
         return @ptrCast(result);
@@ -127,18 +110,8 @@ const std_vtable = opaque {
         free(buf.ptr);
     }
 
-    fn stdResize(_: *anyopaque, buf: []u8, buf_align: u8, new_len: usize, _: usize) bool {
-        const new_buf: [*]u8 = @ptrCast(malloc(new_len) orelse return false);
-        std.debug.assert((@intFromPtr(new_buf) % (@as(u32, 1 ) << @truncate(buf_align))) == 0);
-
-        if (buf.len < new_len) {
-            @memcpy(new_buf[0..buf.len], buf);
-        } else {
-            @memcpy(new_buf[0..new_len], buf[0..new_len]);
-        }
-
-        free(buf.ptr);
-        return true;
+    fn stdResize(_: *anyopaque, buf: []u8, _: u8, new_len: usize, _: usize) bool {
+        return UniversalAllocator.resize(buf.ptr, new_len);
     }
 }.vtable;
 
@@ -151,6 +124,10 @@ pub const MapFlags = packed struct {
     large: bool = false,
     exec: bool = false,
     cache_disable: bool = false,
+    /// Writes are combined in the buffers and issued in bursts, reads are uncached.
+    /// Intended for framebuffers and prefetchable device memory.
+    /// If the architecture doesn't support it, the memory is uncached.
+    write_combining: bool = false,
 
     // Ensure that the size of `MapFlags` matches the size of a byte.
     comptime {
@@ -169,16 +146,44 @@ var root_pt: *PageTable = undefined;
 /// The kernel heap used for allocation virtual address ranges.
 var heap = Heap.init(heap_start);
 var heap_lock = utils.Spinlock.init(.unlocked);
+/// Serializes changes of the heap mappings in the `root_pt`,
+/// unmapping frees page tables that mapping may be filling (see `heapMap`).
+var heap_pt_lock = utils.Spinlock.init(.unlocked);
+
+/// Virtually contiguous area allocated by `vmalloc`.
+const VmArea = struct {
+    const Tree = utils.RbTree(usize, cmpBase);
+
+    node: Tree.Node,
+    region: VirtualRegion,
+
+    /// Reserved heap range, it may be bigger than the region to align it.
+    heap_base: usize,
+    heap_pages: u32,
+
+    fn cmpBase(lhs: *const usize, rhs: *const usize) utils.CmpResult {
+        if (lhs.* == rhs.*) return .equals;
+        return if (lhs.* < rhs.*) .less else .great;
+    }
+};
+
+/// Rank of the blocks that `vmalloc` maps with 2 MB pages.
+const vm_large_rank = std.math.log2_int(u32, (utils.mb_size * 2) / page_size);
+const vm_large_pages = 1 << vm_large_rank;
+
+var vm_areas = VmArea.Tree{};
+var vm_areas_lock = utils.Spinlock.init(.unlocked);
+var vm_area_oma = SafeOma(VmArea).init(32);
 
 /// Initializes the virtual memory management system. Must be called only once.
 /// 
-/// This function sets up the `PageAllocator`, `ObjectAllocator's` system and the architecture-specific
+/// This function sets up the `PageAllocator` and the architecture-specific
 /// virtual memory system. It also maps initial memory regions based on the kernel's memory mappings.
 /// 
 /// - Returns: An error if the initialization fails.
 pub fn init() Error!void {
-    try ObjectAllocator.initOmaSystem();
     try PageAllocator.init();
+    cache.init();
 
     try arch.vm.init();
 
@@ -282,29 +287,92 @@ pub inline fn mmio(phys: usize, pages: u32) Error!usize {
         break :blk heap.reserve(pages);
     };
 
-    try mmap(
-        virt, phys, pages,
-        .{ .write = true, .global = true, .cache_disable = true },
-        root_pt
-    );
+    errdefer heapRelease(virt, pages);
+
+    try heapMap(virt, phys, pages, .{ .write = true, .global = true, .cache_disable = true });
 
     return virt;
 }
 
 /// Unmaps a previously mapped MMIO (Memory-Mapped I/O) region.
+/// The TLB entries are invalidated on all CPUs before
+/// the virtual range is released for the reuse.
 /// 
 /// - `virt`: The virtual address returned by `mmio`.
 /// - `pages`: The number of pages, must be the same as in `mmio` call.
-pub inline fn unmmio(virt: usize, pages: u32) void {
+pub fn unmmio(virt: usize, pages: u32) void {
     std.debug.assert(virt >= heap_start and pages > 0);
 
-    heap_lock.lock();
-    defer heap_lock.unlock();
+    // MMIO is mapped with 4 KB pages, nothing to split
+    heapUnmap(virt, pages) catch unreachable;
+
+    heapRelease(virt, pages);
+}
+
+/// Allocates virtually contiguous memory on the kernel heap.
+/// The memory is backed by the physical blocks of the highest available ranks
+/// down to single pages, so it doesn't need a contiguous physical block.
+/// Blocks of 2 MB and bigger are mapped with large pages.
+/// 
+/// The memory is out of the LMA region, use `getPhys` to translate it.
+/// 
+/// - `size`: The size of the memory in bytes.
+/// - Returns: The pointer to the memory or `null` if there is not enough memory.
+pub fn vmalloc(size: usize) ?*anyopaque {
+    std.debug.assert(size > 0);
+
+    const pages: u32 = @truncate(std.math.divCeil(usize, size, page_size) catch unreachable);
+    const use_large = pages >= vm_large_pages;
+
+    // Reserve more to align the base to the large page
+    const heap_pages = if (use_large) pages + vm_large_pages - 1 else pages;
+    const heap_base = heapReserve(heap_pages);
+    const base = if (use_large) std.mem.alignForward(usize, heap_base, vm_large_pages * page_size) else heap_base;
+
+    const area = vm_area_oma.alloc() orelse {
+        heapRelease(heap_base, heap_pages);
+        return null;
+    };
 
-    heap.release(virt, pages);
+    area.* = .{
+        .node = VmArea.Tree.Node.init(base),
+        .region = VirtualRegion.init(base),
+        .heap_base = heap_base,
+        .heap_pages = heap_pages,
+    };
 
-    // It is a lazy unmap, so we don't have to unmap the region directly,
-    // it will be remapped for the next allocation.
+    if (!fillVmArea(area, pages)) {
+        destroyVmArea(area);
+        return null;
+    }
+
+    vm_areas_lock.lock();
+    defer vm_areas_lock.unlock();
+
+    vm_areas.insert(&area.node);
+
+    return @ptrFromInt(base);
+}
+
+/// Frees the memory allocated by `vmalloc`.
+/// A pointer not returned by `vmalloc` is logged and ignored.
+/// 
+/// - `ptr`: The pointer returned by `vmalloc`.
+pub fn vfree(ptr: *anyopaque) void {
+    const area: *VmArea = blk: {
+        vm_areas_lock.lock();
+        defer vm_areas_lock.unlock();
+
+        const node = vm_areas.find(@as(usize, @intFromPtr(ptr))) orelse {
+            log.err("vfree: 0x{x} is not allocated by vmalloc", .{@intFromPtr(ptr)});
+            return;
+        };
+        vm_areas.removeNode(node);
+
+        break :blk @fieldParentPtr("node", node);
+    };
+
+    destroyVmArea(area);
 }
 
 /// Allocates new page table and maps all neccessary kernel units.
@@ -318,6 +386,22 @@ pub inline fn newPt() ?*PageTable {
     return pt;
 }
 
+/// Handles the page fault on a not present page.
+/// 
+/// - `virt`: The faulting virtual address.
+/// - Returns: `true` if the page is mapped now and the access can be restarted,
+///   `false` if the fault is fatal.
+pub fn handlePageFault(virt: usize) bool {
+    return VirtualRegion.handleFault(virt);
+}
+
+/// Frees the page table allocated by `newPt`.
+/// The page table must not be used by any CPU.
+pub inline fn deletePt(pt: *PageTable) void {
+    arch.vm.releasePt(pt);
+    freePt(pt);
+}
+
 pub inline fn getRootPt() *PageTable {
     return root_pt;
 }
@@ -333,6 +417,33 @@ pub inline fn heapReserve(pages: u32) usize {
     return heap.reserve(pages);
 }
 
+/// Maps a physical memory range into the kernel heap.
+/// The mapping is added to the `root_pt`, the heap part of it
+/// is shared with the page tables of all CPUs (see `newPt`).
+/// 
+/// - `virt`: A base virtual address reserved with `heapReserve`.
+/// - `phys`: A base physical address.
+/// - `pages`: The number of pages to map.
+/// - `flags`: The mapping flags.
+pub fn heapMap(virt: usize, phys: usize, pages: u32, flags: MapFlags) Error!void {
+    heap_pt_lock.lock();
+    defer heap_pt_lock.unlock();
+
+    try mmap(virt, phys, pages, flags, root_pt);
+}
+
+/// Unmaps a kernel heap range mapped with `heapMap`,
+/// the TLB entries are invalidated on all CPUs.
+/// 
+/// - `virt`: A base virtual address of the range.
+/// - `pages`: The number of pages to unmap.
+pub fn heapUnmap(virt: usize, pages: u32) Error!void {
+    heap_pt_lock.lock();
+    defer heap_pt_lock.unlock();
+
+    try unmap(virt, pages, root_pt);
+}
+
 /// Release virtual addresses region on kernel heap.
 /// 
 /// - `base`: A base virtual address of the region.
@@ -342,4 +453,33 @@ pub inline fn heapRelease(base: usize, pages: u32) void {
     defer heap_lock.unlock();
 
     heap.release(base, pages);
-}
\ No newline at end of file
+}
+
+/// Grows the region of the area up to `pages` with the biggest blocks available.
+/// Blocks of each rank are allocated in batches (see `VirtualRegion.growBatch`).
+/// Ranks only decrease, so the blocks of 2 MB stay aligned in the virtual space.
+fn fillVmArea(area: *VmArea, pages: u32) bool {
+    const region = &area.region;
+    var rank: u8 = @min(std.math.log2_int(u32, pages), PageAllocator.max_rank - 1);
+
+    while (region.pagesNum() < pages) {
+        const left = pages - region.pagesNum();
+        rank = @min(rank, std.math.log2_int(u32, left));
+
+        const flags = MapFlags{ .write = true, .global = true, .large = rank >= vm_large_rank };
+        if (region.growBatch(rank, left >> @truncate(rank), flags) > 0) continue;
+
+        if (rank == 0) return false;
+        rank -= 1;
+    }
+
+    return true;
+}
+
+fn destroyVmArea(area: *VmArea) void {
+    // Unmaps the region before the pages are freed
+    area.region.deinit();
+    heapRelease(area.heap_base, area.heap_pages);
+
+    vm_area_oma.free(area);
+}
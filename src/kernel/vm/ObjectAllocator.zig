@@ -7,6 +7,18 @@
 //! 
 //! This allocator is particularly fast and not prone to fragmentation.
 //! The additional memory overhead is practically nonexistent, except for allocating a few bytes per arena.
+//!
+//! Arena pools are allocated from `vm.PageAllocator`, so they are aligned to their size.
+//! The arena descriptor is stored at the end of its pool, the arena of any object
+//! is found in constant time by aligning the object address down (see `getArena`).
+//!
+//! Arenas are kept in the partial, full and empty lists, so allocation takes the first
+//! partial arena without scanning. Up to `max_empty_arenas` (see `Options`) empty arenas are held back
+//! for reuse instead of being freed at once, this prevents alloc/free thrash at arena boundaries.
+//!
+//! Objects can be aligned (e.g. to the cache line) and the first object of successive
+//! arenas can be staggered by the cache line size (colouring, see `Options`),
+//! so objects at the same offset of different arenas don't collide in the same cache sets.
 //! 
 //! Best choise for allocating objects of the same size.
 
@@ -14,13 +26,12 @@
 
 const std = @import("std");
 
-const boot = @import("../boot.zig");
 const utils = @import("../utils.zig");
 const vm = @import("../vm.zig");
 
 const FreeList_t = utils.SList(void);
 const FreeNode = FreeList_t.Node;
-const ArenaList_t = utils.SList(Arena);
+const ArenaList_t = utils.List(Arena);
 const ArenaNode = ArenaList_t.Node;
 
 const Arena = struct {
@@ -35,11 +46,24 @@ const Arena = struct {
     /// Free list for managing deallocated objects.
     free_list: FreeList_t = FreeList_t{},
 
+    /// Allocator owning the arena.
+    owner: *Self = undefined,
+
+    /// Offset of the first object in the pool.
+    colour: u32 = 0,
+
     /// Initializes an `Arena` structure.
     /// 
     /// - `phys_pool`: The physical memory address of the pool.
-    pub fn init(phys_pool: usize) Arena {
-        return Arena{ .pool_base = @truncate(phys_pool / vm.page_size), .next_ptr = vm.getVirtLma(phys_pool) };
+    /// - `owner`: The allocator owning the arena.
+    /// - `colour`: Offset of the first object in the pool.
+    pub fn init(phys_pool: usize, owner: *Self, colour: u32) Arena {
+        return Arena{
+            .pool_base = @truncate(phys_pool / vm.page_size),
+            .next_ptr = vm.getVirtLma(phys_pool) + colour,
+            .owner = owner,
+            .colour = colour
+        };
     }
 
     /// Allocates memory for an object of size `obj_size`.
@@ -96,37 +120,56 @@ const Arena = struct {
     pub inline fn getBase(self: *const Arena) usize {
         return vm.getVirtLma(@as(usize, self.pool_base) * vm.page_size);
     }
+
+    /// Resets the arena without allocated objects to its initial state.
+    inline fn reset(self: *Arena) void {
+        std.debug.assert(self.alloc_num == 0);
+
+        self.next_ptr = self.getBase() + self.colour;
+        self.free_list = .{};
+    }
 };
 
 const Self = @This();
 
-arenas: ArenaList_t = ArenaList_t{},
+/// Default number of the empty arenas held back for reuse.
+pub const max_empty_arenas = 2;
+
+/// Objects placement options.
+pub const Options = struct {
+    /// Alignment of the objects in bytes, must be power of two.
+    /// `0` means the objects are packed one by one.
+    alignment: u32 = 0,
+    /// Stagger the first object of successive arenas
+    /// by the cache line size (or alignment if it's larger).
+    colouring: bool = false,
+    /// Number of the empty arenas held back for reuse.
+    empty_arenas: u32 = max_empty_arenas,
+};
+
+/// Arenas with both allocated and free objects.
+partial: ArenaList_t = ArenaList_t{},
+/// Arenas without free objects.
+full: ArenaList_t = ArenaList_t{},
+/// Arenas without allocated objects.
+empty: ArenaList_t = ArenaList_t{},
+
 arena_capacity: u32 = undefined,
 
 /// Rank (log2 of the number of pages) of the arenas.
 arena_rank: u32 = undefined,
+/// Size of the object including the alignment padding.
 obj_size: usize = undefined,
 
-/// Target capacity of bucket for arena nodes allocator.
-const arenas_tar_capacity = 256;
-/// Allocator for managing arena nodes.
-var arenas_alloc: vm.BucketAllocator = undefined;
-var arenas_lock = utils.Spinlock.init(.unlocked);
-
-/// Initializes the Object Memory Allocator (OMA) system.
-/// 
-/// - Returns: An error if the memory could not be allocated.
-pub fn initOmaSystem() vm.Error!void {
-    const pool_size = arenas_tar_capacity * @sizeOf(ArenaNode);
-    const pool_pages = std.math.divCeil(comptime_int, pool_size, vm.page_size) catch unreachable;
-
-    comptime std.debug.assert(std.math.isPowerOfTwo(pool_pages));
+/// Colour offset step, `0` if colouring is disabled.
+colour_step: u32 = 0,
+/// Maximum colour offset: unused space at the end of the arena.
+colour_max: u32 = 0,
+/// Colour offset of the next arena.
+next_colour: u32 = 0,
 
-    const mem_pool = boot.alloc(pool_pages) orelse return vm.Error.NoMemory;
-    const virt_pool = vm.getVirtLma(mem_pool);
-
-    arenas_alloc = vm.BucketAllocator.initRaw(ArenaNode, virt_pool, pool_pages);
-}
+/// Number of the empty arenas held back for reuse.
+max_empty: u32 = max_empty_arenas,
 
 /// Initializes an allocator for a specific object type.
 /// 
@@ -143,12 +186,23 @@ pub fn init(comptime T: type) Self {
 /// 
 /// - `obj_size`: The size of the objects to allocate.
 /// - `capacity`: The number of the objects per arena.
-pub fn initCapacity(comptime obj_size: usize, comptime capacity: usize) Self {
+pub inline fn initCapacity(comptime obj_size: usize, comptime capacity: usize) Self {
+    return initCapacityEx(obj_size, capacity, .{});
+}
+
+/// Initializes an allocator with a specified object size, capacity per arena
+/// and objects placement options.
+/// 
+/// - `obj_size`: The size of the objects to allocate.
+/// - `capacity`: The number of the objects per arena.
+/// - `options`: Objects alignment and colouring.
+pub fn initCapacityEx(comptime obj_size: usize, comptime capacity: usize, comptime options: Options) Self {
     std.debug.assert(obj_size >= @sizeOf(FreeNode));
 
-    const pages = std.math.divCeil(comptime_int, obj_size * capacity, vm.page_size) catch unreachable;
+    const real_size = if (options.alignment > 0) std.mem.alignForward(usize, obj_size, options.alignment) else obj_size;
+    const pages = std.math.divCeil(comptime_int, real_size * capacity, vm.page_size) catch unreachable;
 
-    return initSized(obj_size, pages);
+    return initSizedEx(obj_size, pages, options);
 }
 
 /// Initializes an allocator with a specified object size and number of pages per arena.
@@ -158,47 +212,61 @@ pub fn initCapacity(comptime obj_size: usize, comptime capacity: usize) Self {
 ///
 /// @export
 pub fn initSized(obj_size: usize, pages: u32) Self {
+    return initSizedEx(obj_size, pages, .{});
+}
+
+/// Initializes an allocator with a specified object size, number of pages per arena
+/// and objects placement options.
+/// 
+/// - `obj_size`: The size of the objects to allocate.
+/// - `pages`: The number of pages to allocate for the arena.
+/// - `options`: Objects alignment and colouring.
+pub fn initSizedEx(obj_size: usize, pages: u32, options: Options) Self {
     std.debug.assert(obj_size >= @sizeOf(FreeNode));
+    std.debug.assert(options.alignment == 0 or std.math.isPowerOfTwo(options.alignment));
+
+    const real_size: u32 = @truncate(
+        if (options.alignment > 0) std.mem.alignForward(usize, obj_size, options.alignment) else obj_size
+    );
 
     const rank: u32 = std.math.log2_int_ceil(u32, @truncate(pages));
     const real_pages = @as(u32, 1) << @truncate(rank);
-    const real_capacity: u32 = (real_pages * vm.page_size) / @as(u32, @truncate(obj_size));
+    // The end of the pool is occupied by the arena node.
+    const pool_size: u32 = real_pages * vm.page_size - @sizeOf(ArenaNode);
+    const real_capacity: u32 = pool_size / real_size;
 
     std.debug.assert(real_capacity > 1);
 
-    return Self{ .arena_capacity = real_capacity, .arena_rank = rank, .obj_size = obj_size };
+    return Self{
+        .arena_capacity = real_capacity,
+        .arena_rank = rank,
+        .obj_size = real_size,
+        .colour_step = if (options.colouring) @max(options.alignment, utils.cache_line_size) else 0,
+        .colour_max = pool_size - (real_capacity * real_size),
+        .max_empty = options.empty_arenas,
+    };
 }
 
-/// Initializes an allocator with a specified object size and physical memory pool.
+/// Initializes an allocator in place with a specified object size and physical memory pool.
+/// The arena keeps a pointer to the allocator, so it can't be moved after that.
 /// 
 /// - `obj_size`: The size of the object.
-/// - `pool_phys`: The physical memory address of the pool.
+/// - `pool_phys`: The physical memory address of the pool, must be aligned to the pool size.
 /// - `pool_pages`: The number of pages in the pool.
-/// - Returns: A `Self` structure or an error if the allocation fails.
-pub fn initRaw(obj_size: usize, pool_phys: usize, pool_pages: u32) vm.Error!Self {
-    var result = initSized(obj_size, pool_pages);
-
-    const real_pages = @as(u32, 1) << @truncate(result.arena_rank);
-    std.debug.assert(real_pages == pool_pages);
+pub fn initRaw(self: *Self, obj_size: usize, pool_phys: usize, pool_pages: u32) void {
+    self.* = initSized(obj_size, pool_pages);
 
-    const node = makeArena(pool_phys) orelse return error.NoMemory;
-    result.arenas.prepend(node);
+    const real_pages = @as(u32, 1) << @truncate(self.arena_rank);
+    std.debug.assert(real_pages == pool_pages and (pool_phys % self.getArenaSize()) == 0);
 
-    return result;
+    self.empty.prepend(self.makeArena(pool_phys));
 }
 
 /// Deinitialize allocator, free all allocated memory.
 pub export fn deinit(self: *Self) void {
-    var node = self.arenas.first;
-
-    while (node) |arena| {
-        const next = arena.next;
-        self.freeArena(arena);
-
-        node = next;
+    for ([_]*ArenaList_t{ &self.partial, &self.full, &self.empty }) |list| {
+        while (list.pop()) |arena| self.freeArena(arena);
     }
-
-    self.arenas.first = null;
 }
 
 /// Allocates memory for an object and cast it to pointer of type `T`.
@@ -233,101 +301,121 @@ pub inline fn free(self: *Self, obj_ptr: anytype) void {
 /// - `obj_addr`: Address of the object, managed by the arena, to free.
 ///
 /// @noexport
-pub inline fn freeRaw(self: *Self, arena: *ArenaNode, obj_addr: usize) void {
+pub fn freeRaw(self: *Self, arena: *ArenaNode, obj_addr: usize) void {
+    const list = if (arena.data.alloc_num == self.arena_capacity) &self.full else &self.partial;
+
     arena.data.free(obj_addr, self.obj_size);
 
-    if (arena.data.alloc_num == 0) self.deleteArena(arena);
+    if (arena.data.alloc_num == 0) {
+        list.remove(arena);
+        arena.data.reset();
+
+        self.empty.prepend(arena);
+
+        // Free the least recently used empty arena
+        if (self.empty.len > self.max_empty) self.freeArena(self.empty.pop().?);
+    } else if (list == &self.full) {
+        self.full.remove(arena);
+        self.partial.prepend(arena);
+    }
 }
 
 /// Find allocator's arena that manage the address.
+/// Unlike `getArena`, walks all arenas and accepts any address.
 /// 
 /// - `addr`: The address of the object.
 /// - Returns: A pointer to the arena if the address is managed by the allocator, `null` otherwise.
 ///
 /// @noexport
-pub inline fn contains(self: *const Self, addr: usize) ?*ArenaNode {
-    var node = self.arenas.first;
+pub fn contains(self: *const Self, addr: usize) ?*ArenaNode {
     const arena_size = self.getArenaSize();
 
-    while (node) |arena| : (node = arena.next) {
-        if (arena.data.contains(addr, arena_size)) {
-            return arena;
+    for ([_]*const ArenaList_t{ &self.partial, &self.full, &self.empty }) |list| {
+        var node = list.first;
+
+        while (node) |arena| : (node = arena.next) {
+            if (arena.data.contains(addr, arena_size)) {
+                return arena;
+            }
         }
     }
 
     return null;
 }
 
+/// Returns the arena containing the object in constant time.
+/// 
+/// - `addr`: The address of an object allocated from an arena of `2^rank` pages.
+///
+/// @noexport
+pub inline fn getArena(addr: usize, rank: u32) *ArenaNode {
+    const arena_size = (@as(usize, 1) << @truncate(rank)) * vm.page_size;
+    const base = addr - (vm.getPhysLma(addr) % arena_size);
+
+    return @ptrFromInt(base + arena_size - @sizeOf(ArenaNode));
+}
+
 /// Returns the arena size in bytes for the current allocator.
 inline fn getArenaSize(self: *const Self) usize {
     return (@as(u32, 1) << @truncate(self.arena_rank)) * vm.page_size;
 }
 
 export fn allocEx(self: *Self) ?*anyopaque {
-    var node = self.arenas.first;
+    const arena = self.partial.first orelse blk: {
+        const arena = self.empty.popFirst() orelse self.newArena() orelse return null;
+        self.partial.prepend(arena);
 
-    while (node) |arena| : (node = arena.next) {
-        if (arena.data.alloc_num < self.arena_capacity) break;
-    }
+        break :blk arena;
+    };
 
-    var arena: *ArenaNode = undefined;
+    const addr = arena.data.alloc(self.obj_size);
 
-    if (node) |ptr| {
-        arena = ptr;
-    } else {
-        arena = self.newArena() orelse return null;
+    if (arena.data.alloc_num == self.arena_capacity) {
+        self.partial.remove(arena);
+        self.full.prepend(arena);
     }
 
-    return @ptrFromInt(arena.data.alloc(self.obj_size));
+    return @ptrFromInt(addr);
 }
 
 export fn freeEx(self: *Self, obj_addr: usize) void {
-    const arena = self.contains(obj_addr) orelse unreachable;
+    const arena = getArena(obj_addr, self.arena_rank);
+    std.debug.assert(arena.data.owner == self);
+
     self.freeRaw(arena, obj_addr);
 }
 
-/// Creates a new arena and initializes it with a given physical memory pool.
+/// Initializes a new arena node at the end of a given physical memory pool.
 /// 
 /// - `pool_phys`: The physical memory address of the pool.
-/// - Returns: A pointer to the newly created `ArenaNode`, or `null` if allocation fails.
-fn makeArena(phys_pool: usize) ?*ArenaNode {
-    const node = blk: {
-        arenas_lock.lock();
-        defer arenas_lock.unlock();
+/// - Returns: A pointer to the newly created `ArenaNode`.
+fn makeArena(self: *Self, phys_pool: usize) *ArenaNode {
+    const node: *ArenaNode = @ptrFromInt(vm.getVirtLma(phys_pool) + self.getArenaSize() - @sizeOf(ArenaNode));
 
-        break :blk arenas_alloc.alloc(ArenaNode) orelse return null;
-    };
-
-    node.data = Arena.init(phys_pool);
+    node.* = .{ .data = Arena.init(phys_pool, self, self.nextColour()) };
     return node;
 }
 
-/// Allocates and initializes a new arena for the allocator.
-/// 
-/// - Returns: A pointer to the newly created `ArenaNode`, or `null` if allocation fails.
-pub fn newArena(self: *Self) ?*ArenaNode {
-    const phys = vm.PageAllocator.alloc(self.arena_rank) orelse return null;
-    const node = makeArena(phys) orelse {
-        vm.PageAllocator.free(phys, self.arena_rank);
-        return null;
-    };
+/// Returns the colour offset for a new arena and advances it.
+inline fn nextColour(self: *Self) u32 {
+    const colour = self.next_colour;
 
-    self.arenas.prepend(node);
-    return node;
+    self.next_colour = if (colour + self.colour_step <= self.colour_max) colour + self.colour_step else 0;
+    return colour;
 }
 
-/// Deletes an arena and frees its memory.
+/// Allocates and initializes a new arena for the allocator.
+/// The arena is not added to any list.
 /// 
-/// - `arena`: Pointer to the `ArenaNode` to delete.
-fn deleteArena(self: *Self, arena: *ArenaNode) void {
-    self.arenas.remove(arena);
-    self.freeArena(arena);
+/// - Returns: A pointer to the newly created `ArenaNode`, or `null` if allocation fails.
+fn newArena(self: *Self) ?*ArenaNode {
+    const phys = vm.PageAllocator.alloc(self.arena_rank) orelse return null;
+    return self.makeArena(phys);
 }
 
-/// Free arena memory.
+/// Free arena memory, the arena node is freed along with the pool.
 /// 
 /// - `arena`: Pointer to the `ArenaNode` to free.
 inline fn freeArena(self: *Self, arena: *ArenaNode) void {
     vm.PageAllocator.free(@as(usize, arena.data.pool_base) * vm.page_size, self.arena_rank);
-    arenas_alloc.free(arena);
 }
@@ -2,62 +2,674 @@
 //! Implements a buddy page allocator for managing physical pages of memory.
 //! Provides functions for allocating and freeing pages, 
 //! and accessing the status of the free/used physical memory.
+//!
+//! Physical memory is split into nodes by the ACPI SRAT proximity domains,
+//! each node has its own buddy lists and lock. Allocations are served
+//! from the node of the current CPU, other nodes are used in order
+//! of the SLIT distance. Without SRAT all memory belongs to a single node.
+//!
+//! Low-rank blocks (up to `pcp_max_rank`) are served from per-CPU lists
+//! placed in front of the buddy lists. These lists are refilled and drained
+//! in batches, so the common case does not touch the node lock.
+//!
+//! Each node also keeps a pool of pre-zeroed low-rank blocks for `allocZeroed`.
+//! The pool is topped up by idle CPUs (see `fillZeroed`), an idle CPU halted
+//! in `waitZeroed` is woken up when the pool drops below the low watermark.
+//!
+//! When an allocation of rank `compact_min_rank` or higher fails, the allocator
+//! runs the compaction: movable blocks are migrated out of a partially
+//! free region, so it can coalesce into a high-rank block. Owners of movable
+//! blocks register a `Mover` to take part in it.
+//!
+//! Free blocks are grouped by the mobility type in pageblocks
+//! (2^`pageblock_rank` pages), so unmovable allocations do not scatter
+//! over the memory and leave the movable pageblocks compactable.
+//!
+//! Only the first `bootstrap_pages` of each node are added to the buddy lists
+//! at initialization. The rest of memory is added in chunks by the APs
+//! after `smp.initAll` (see `initDeferred`), or on demand if allocation fails.
 
 // Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
 
 const std = @import("std");
 
+const acpi = @import("../dev/stds/acpi.zig");
 const boot = @import("../boot.zig");
+const intr = @import("../dev/intr.zig");
 const math = std.math;
+const smp = @import("../smp.zig");
 const utils = @import("../utils.zig");
 const vm = @import("../vm.zig");
 const log = std.log.scoped(.PageAllocator);
 
 const Spinlock = utils.Spinlock;
 
+/// Allocation mobility type.
+/// Blocks of the same type are grouped in pageblocks (see `pageblock_rank`),
+/// so unmovable allocations don't prevent coalescing of the movable memory.
+pub const Mobility = enum(u8) {
+    /// Can't be moved or freed on demand: page tables, kernel objects.
+    unmovable,
+    /// Can be freed on demand: caches storage.
+    reclaimable,
+    /// Can be migrated by the compaction.
+    movable,
+};
+
+const mobility_num = @typeInfo(Mobility).@"enum".fields.len;
+
 /// Represents a free memory area in the buddy allocator. 
-/// It maintains a list of free nodes and a bitmap for tracking free pages.
+/// It maintains a list of free nodes per mobility type
+/// and a bitmap for tracking free pages.
+///
+/// The lists are doubly linked, so the buddy can be removed from it
+/// in constant time while coalescing.
 const FreeArea = struct {
-    pub const List_t = utils.SList(void);
+    pub const List_t = utils.List(void);
 
-    list: List_t = List_t{},
+    lists: [mobility_num]List_t = .{List_t{}} ** mobility_num,
     bitmap: utils.Bitmap = undefined,
 
     pub fn format(value: @This(), comptime _: []const u8, _: std.fmt.FormatOptions, writer: anytype) !void {
-        try writer.print("Free list: ", .{});
+        try writer.print("Free lists: ", .{});
 
-        var curr_node = value.list.first;
+        for (value.lists, 0..) |list, i| {
+            try writer.print("{s}: ", .{@tagName(@as(Mobility, @enumFromInt(i)))});
 
-        if (curr_node == null) {
-            try writer.print("empty", .{});
-            return;
+            var curr_node = list.first;
+
+            if (curr_node == null) {
+                try writer.print("empty; ", .{});
+                continue;
+            }
+
+            try writer.print("{{ ", .{});
+
+            while (curr_node) |node| : (curr_node = node.next) {
+                try writer.print("0x{x}", .{entGetPhys(node)});
+
+                if (node.next != null) try writer.print(", ", .{});
+            }
+
+            try writer.print(" }}; ", .{});
         }
+    }
+};
 
-        try writer.print("{{ ", .{});
+const FreeNode = FreeArea.List_t.Node;
 
-        while (curr_node) |node| : (curr_node = node.next) {
-            try writer.print("0x{x}", .{entGetPhys(node)});
+/// Memory node (NUMA proximity domain) with its own buddy lists.
+const MemNode = struct {
+    free_areas: [max_areas]FreeArea = .{FreeArea{}} ** max_areas,
+    lock: Spinlock = Spinlock.init(.unlocked),
+
+    /// First page of the node, aligned to the maximum block size.
+    base: u32 = math.maxInt(u32),
+    /// Page next to the last page of the node.
+    end: u32 = 0,
+    /// ACPI proximity domain.
+    domain: u32 = 0,
+    /// Number of free pages at initialization.
+    pages: usize = 0,
+
+    /// Indices of the nodes ordered by the distance from this one,
+    /// the node itself is the first.
+    fallback: [max_nodes]u8 = undefined,
+    fallback_len: u8 = 0,
+
+    /// Mobility type of each pageblock.
+    pageblock_types: []Mobility = &.{},
+
+    /// Pre-zeroed blocks, allocated from the buddy lists.
+    zeroed: [zeroed_ranks]ZeroedList = .{ZeroedList{}} ** zeroed_ranks,
+    zeroed_lock: Spinlock = Spinlock.init(.unlocked),
+    /// Index + 1 of the idle CPU halted in `waitZeroed`, `0` if there is none.
+    zeroed_filler: std.atomic.Value(u16) = std.atomic.Value(u16).init(0),
+
+    inline fn isEmpty(self: *const MemNode) bool {
+        return self.end <= self.base;
+    }
 
-            if (node.next != null) try writer.print(", ", .{});
+    /// Takes the lock with interrupts disabled on the current CPU,
+    /// blocks are freed from interrupt handlers too.
+    ///
+    /// - Returns: The interrupts state for `unlockIntr`.
+    inline fn lockIntr(self: *MemNode) bool {
+        const intr_state = intr.saveAndDisableForCpu();
+        self.lock.lock();
+
+        return intr_state;
+    }
+
+    inline fn unlockIntr(self: *MemNode, intr_state: bool) void {
+        self.lock.unlock();
+        intr.restoreForCpu(intr_state);
+    }
+
+    /// Takes the pre-zeroed pool lock with interrupts disabled on the current CPU,
+    /// `drainZeroed` takes the node lock under it.
+    ///
+    /// - Returns: The interrupts state for `unlockZeroed`.
+    inline fn lockZeroed(self: *MemNode) bool {
+        const intr_state = intr.saveAndDisableForCpu();
+        self.zeroed_lock.lock();
+
+        return intr_state;
+    }
+
+    inline fn unlockZeroed(self: *MemNode, intr_state: bool) void {
+        self.zeroed_lock.unlock();
+        intr.restoreForCpu(intr_state);
+    }
+
+    fn allocLocked(self: *MemNode, rank: u32, mobility: Mobility) ?usize {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        return self.allocBlock(rank, mobility);
+    }
+
+    fn freeLocked(self: *MemNode, base: u32, rank: u32) void {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        self.freeBlock(base, rank);
+    }
+
+    fn pushFreeLocked(self: *MemNode, base: u32, pages: u32) void {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        self.pushFree(base, pages);
+    }
+
+    /// Returns the base of an aligned region of `2^rank` pages
+    /// containing the largest free movable block, the region is at least partially free.
+    /// 
+    /// - `skip`: Regions to ignore.
+    fn findCompactRegion(self: *MemNode, rank: u32, skip: []const u32) ?u32 {
+        const region_mask = ~((@as(u32, 1) << @truncate(rank)) - 1);
+
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        var temp_rank = rank;
+
+        while (temp_rank > 0) {
+            temp_rank -= 1;
+
+            var entry = self.free_areas[temp_rank].lists[@intFromEnum(Mobility.movable)].first;
+
+            search: while (entry) |ent| : (entry = ent.next) {
+                const region = entGetBase(ent) & region_mask;
+
+                for (skip) |skip_region| {
+                    if (skip_region == region) continue :search;
+                }
+
+                return region;
+            }
+        }
+
+        return null;
+    }
+
+    /// Removes all free blocks placed in the pages range `[begin, end)`
+    /// from the buddy lists and puts them into the isolated list.
+    fn isolateFree(self: *MemNode, begin: u32, end: u32, rank: u32) void {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        for (0..rank) |i| {
+            const temp_rank: u32 = @truncate(i);
+
+            for (&self.free_areas[temp_rank].lists) |*list| {
+                var entry = list.first;
+
+                while (entry) |ent| {
+                    entry = ent.next;
+
+                    const base = entGetBase(ent);
+                    if (base < begin or base >= end) continue;
+
+                    list.remove(ent);
+                    self.togglePageBit(base, temp_rank);
+
+                    isolateBlock(base, temp_rank);
+                }
+            }
         }
+    }
+
+    /// Takes a block from the pre-zeroed pool.
+    /// Wakes up the filler if the pool drops below the low watermark.
+    fn takeZeroed(self: *MemNode, rank: u32) ?usize {
+        var is_low = false;
+        const taken = blk: {
+            const intr_state = self.lockZeroed();
+            defer self.unlockZeroed(intr_state);
+
+            const list = &self.zeroed[rank];
+            const first = list.popFirst();
+            is_low = list.len < zeroedLowOf(rank);
+
+            break :blk first;
+        };
+
+        if (is_low) self.wakeZeroedFiller();
+        const entry = taken orelse return null;
+
+        // Clear the list node stored in the block
+        entry.* = std.mem.zeroes(ZeroedList.Node);
 
-        try writer.print(" }}", .{});
+        return zeroedNodeGetPhys(entry);
+    }
+
+    /// Puts a zeroed block into the pool.
+    fn putZeroed(self: *MemNode, phys: usize, rank: u32) void {
+        const intr_state = self.lockZeroed();
+        defer self.unlockZeroed(intr_state);
+
+        self.zeroed[rank].prepend(@ptrFromInt(vm.getVirtLma(phys)));
+    }
+
+    inline fn isZeroedFull(self: *MemNode, rank: u32) bool {
+        const intr_state = self.lockZeroed();
+        defer self.unlockZeroed(intr_state);
+
+        return self.zeroed[rank].len >= zeroedHighOf(rank);
+    }
+
+    /// Wakes up the idle CPU halted in `waitZeroed`, if any.
+    fn wakeZeroedFiller(self: *MemNode) void {
+        const filler = self.zeroed_filler.swap(0, .acq_rel);
+        if (filler != 0) intr.wakeCpu(filler - 1);
+    }
+
+    /// Allocates up to `out.len` blocks taking the lock once.
+    ///
+    /// - Returns: The number of allocated blocks.
+    fn allocBlocks(self: *MemNode, rank: u32, mobility: Mobility, out: []usize) u32 {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        for (out, 0..) |*phys, i| {
+            phys.* = self.allocBlock(rank, mobility) orelse return @truncate(i);
+        }
+
+        return @truncate(out.len);
+    }
+
+    /// Returns blocks to the buddy lists taking the lock once.
+    fn freeBlocks(self: *MemNode, blocks: []const usize, rank: u32) void {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        for (blocks) |phys| self.freeBlock(@truncate(phys / vm.page_size), rank);
+    }
+
+    /// Returns a pages range of any length to the buddy lists taking the lock once.
+    /// The range is split into the largest blocks aligned to their size.
+    fn freeRange(self: *MemNode, base: u32, pages: u32) void {
+        const intr_state = self.lockIntr();
+        defer self.unlockIntr(intr_state);
+
+        var temp_base = base;
+        var temp_pages = pages;
+
+        while (temp_pages != 0) {
+            const rank = @min(@ctz(temp_base), math.log2_int(u32, temp_pages), max_rank - 1);
+
+            self.freeBlock(temp_base, rank);
+
+            temp_base += @as(u32, 1) << @truncate(rank);
+            temp_pages -= @as(u32, 1) << @truncate(rank);
+        }
+    }
+
+    /// Allocates a block from the buddy lists of the mobility type.
+    /// Steals a block of another type if there is nothing suitable.
+    /// Must be called with `lock` held.
+    fn allocBlock(self: *MemNode, rank: u32, mobility: Mobility) ?usize {
+        var temp_rank = rank;
+
+        const entry = while (temp_rank < max_areas) : (temp_rank += 1) {
+            if (self.free_areas[temp_rank].lists[@intFromEnum(mobility)].popFirst()) |free_entry| {
+                break free_entry;
+            }
+        } else self.stealBlock(rank, mobility, &temp_rank) orelse return null;
+
+        const base = entGetBase(entry);
+        self.togglePageBit(base, temp_rank);
+
+        // Split the block, the upper halves remain free
+        while (temp_rank > rank) {
+            temp_rank -= 1;
+
+            const half_base = base + (@as(u32, 1) << @truncate(temp_rank));
+
+            self.listOf(half_base, temp_rank).prepend(makeNode(half_base));
+            self.togglePageBit(half_base, temp_rank);
+        }
+
+        return entGetPhys(entry);
+    }
+
+    /// Takes the largest free block of another mobility type.
+    /// If the block covers whole pageblocks, the first one is converted to the mobility type,
+    /// so the following allocations of this type are grouped there.
+    /// Must be called with `lock` held.
+    ///
+    /// - `out_rank`: Receives the rank of the block.
+    fn stealBlock(self: *MemNode, rank: u32, mobility: Mobility, out_rank: *u32) ?*FreeNode {
+        var temp_rank: u32 = max_areas;
+
+        while (temp_rank > rank) {
+            temp_rank -= 1;
+
+            for (&self.free_areas[temp_rank].lists, 0..) |*list, i| {
+                if (i == @intFromEnum(mobility)) continue;
+
+                const entry = list.popFirst() orelse continue;
+
+                // The block covers whole pageblocks, so the first one is taken
+                // entirely and converted, the split upper halves stay in the
+                // lists of their pageblocks types.
+                if (temp_rank >= pageblock_rank) {
+                    self.pageblock_types[(entGetBase(entry) - self.base) >> pageblock_rank] = mobility;
+                }
+
+                _ = @atomicRmw(usize, &mobility_fallbacks[@intFromEnum(mobility)], .Add, 1, .monotonic);
+
+                out_rank.* = temp_rank;
+                return entry;
+            }
+        }
+
+        return null;
+    }
+
+    /// Returns a block to the buddy lists, coalescing it with free buddies.
+    /// Must be called with `lock` held.
+    fn freeBlock(self: *MemNode, base: u32, rank: u32) void {
+        var page_base = base;
+        var temp_rank = rank;
+
+        while (temp_rank < max_rank - 1 and self.getPageBit(page_base, temp_rank) != 0) {
+            const buddy_base = page_base ^ (@as(u32, 1) << @truncate(temp_rank));
+
+            self.clearPageBit(buddy_base, temp_rank);
+            self.listOf(buddy_base, temp_rank).remove(getNode(buddy_base));
+
+            page_base = @min(page_base, buddy_base);
+            temp_rank += 1;
+        }
+
+        self.listOf(page_base, temp_rank).prepend(makeNode(page_base));
+        self.setPageBit(page_base, temp_rank);
+    }
+
+    /// Adds free pages to the buddy lists.
+    /// Splits the memory if necessary to make all pages blocks aligned to
+    /// it's size and updates the bitmap. Blocks are coalesced with the free
+    /// buddies outside of the range, added earlier.
+    fn pushFree(self: *MemNode, base: u32, pages: u32) void {
+        var temp_base = base;
+        var temp_pages = pages;
+
+        while (temp_pages != 0) {
+            var temp_rank: u32 = math.log2_int(u32, temp_pages);
+
+            if (temp_rank >= max_rank) temp_rank = max_rank - 1;
+
+            var rank_pages_num: u32 = @as(u32, 1) << @truncate(temp_rank);
+
+            while ((temp_base % rank_pages_num) != 0) {
+                temp_rank -= 1;
+                rank_pages_num >>= 1;
+            }
+
+            // The buddy may be free already if it was pushed
+            // with a previous deferred chunk, so coalesce with it.
+            self.freeBlock(temp_base, temp_rank);
+
+            temp_base += rank_pages_num;
+            temp_pages -= rank_pages_num;
+        }
+    }
+
+    /// Allocates and initializes the bitmaps and pageblock types covering all pages of the node.
+    /// All pageblocks are movable initially.
+    /// 
+    /// - Returns: The number of pages used for the bitmaps.
+    fn initBitmaps(self: *MemNode) vm.Error!u32 {
+        const span = self.end - self.base;
+        const bitmap_size = math.divCeil(u32, span, utils.byte_size) catch unreachable;
+        const types_size = math.divCeil(u32, span, pageblock_pages) catch unreachable;
+        // Each rank size is rounded up, reserve a byte per rank for it.
+        const pool_size = bitmap_size + max_areas + types_size;
+        const bitmap_pages = math.divCeil(u32, pool_size, vm.page_size) catch unreachable;
+
+        const mem_pool = boot.alloc(bitmap_pages) orelse return vm.Error.NoMemory;
+
+        self.pageblock_types.ptr = @ptrFromInt(vm.getVirtLma(mem_pool));
+        self.pageblock_types.len = types_size;
+
+        @memset(self.pageblock_types, .movable);
+
+        var curr_bitmap_base = vm.getVirtLma(mem_pool) + types_size;
+        var curr_bitmap_size = (bitmap_size >> 1) + (bitmap_size & 1);
+
+        for (&self.free_areas) |*area| {
+            const bits: [*]u8 = @ptrFromInt(curr_bitmap_base);
+            area.bitmap = utils.Bitmap.init(bits[0..curr_bitmap_size], false);
+
+            curr_bitmap_base += curr_bitmap_size;
+            curr_bitmap_size = @max((curr_bitmap_size >> 1) + (curr_bitmap_size & 1), 1);
+        }
+
+        return bitmap_pages;
+    }
+
+    inline fn getPageblockType(self: *const MemNode, base: u32) Mobility {
+        return self.pageblock_types[(base - self.base) >> pageblock_rank];
+    }
+
+    /// Returns the free list of the block by it's pageblock mobility type.
+    inline fn listOf(self: *MemNode, base: u32, rank: u32) *FreeArea.List_t {
+        return &self.free_areas[rank].lists[@intFromEnum(self.getPageblockType(base))];
+    }
+
+    inline fn bitOf(self: *const MemNode, base: u32, rank: u32) usize {
+        return (base - self.base) >> @truncate(1 + rank);
+    }
+
+    inline fn clearPageBit(self: *MemNode, base: u32, rank: u32) void {
+        self.free_areas[rank].bitmap.clear(self.bitOf(base, rank));
+    }
+
+    inline fn setPageBit(self: *MemNode, base: u32, rank: u32) void {
+        self.free_areas[rank].bitmap.set(self.bitOf(base, rank));
+    }
+
+    inline fn getPageBit(self: *MemNode, base: u32, rank: u32) u8 {
+        return self.free_areas[rank].bitmap.get(self.bitOf(base, rank));
+    }
+
+    inline fn togglePageBit(self: *MemNode, base: u32, rank: u32) void {
+        self.free_areas[rank].bitmap.toggle(self.bitOf(base, rank));
     }
 };
 
-const FreeNode = FreeArea.List_t.Node;
+/// Free pages range waiting to be added to the buddy lists.
+/// Stored in the first page of the range.
+const DeferredRange = struct {
+    pages: u32,
+    node: u8,
+};
+
+const DeferredList = utils.SList(DeferredRange);
+
+/// Isolated block kept out of the buddy lists during the compaction.
+/// Stored in the first page of the block.
+const IsolatedList = utils.SList(u8);
+
+/// Callback of a movable blocks owner.
+/// Must migrate all owned blocks placed in the pages range `[begin, end)`
+/// using `migrate`.
+///
+/// The compaction runs in the allocation path on any CPU, so only blocks
+/// the owner can pin itself may be migrated: nobody accesses them during
+/// the call and they are addressed through the LMA, so no remapping or
+/// TLB shootdown is needed (e.g. idle cache blocks).
+///
+/// - Returns: The number of migrated blocks.
+pub const EvacuateFn = *const fn (mover: *Mover, begin: u32, end: u32) u32;
+
+const MoverList = utils.List(EvacuateFn);
+
+/// Owner of movable blocks registered with `registerMover`.
+/// Embedded into the owner and holds it's evacuation callback.
+pub const Mover = MoverList.Node;
+
+/// Compaction statistics.
+pub const CompactStats = struct {
+    /// Number of the compaction passes.
+    runs: usize = 0,
+    /// Number of the recovered high-rank blocks.
+    recovered: usize = 0,
+    /// Number of the migrated blocks.
+    migrated: usize = 0,
+};
+
+/// Physical pages range of a node described by SRAT.
+const Range = struct {
+    base: u32,
+    end: u32,
+    node: u8,
+};
+
+const ZeroedList = utils.List(void);
+
+/// Per-CPU lists of the low-rank blocks.
+/// Accessed only by the owning CPU with interrupts disabled,
+/// since blocks are also freed from interrupt handlers.
+const CpuCache = struct {
+    const List_t = utils.List(void);
+    const Node = List_t.Node;
+
+    lists: [mobility_num][pcp_ranks]List_t = .{.{List_t{}} ** pcp_ranks} ** mobility_num,
+    stats: CpuStats = .{},
+
+    /// Index of the memory node local to the CPU.
+    /// The lists contain only blocks of this node.
+    node: u8 = 0,
+
+    /// Returns the number of blocks moved between per-CPU list
+    /// and buddy lists at once.
+    inline fn batchOf(rank: u32) u32 {
+        return pcp_max_batch >> @truncate(rank);
+    }
+
+    /// Returns the maximum number of blocks in the per-CPU list,
+    /// exceeding it causes the list drain.
+    inline fn highOf(rank: u32) u32 {
+        return batchOf(rank) * pcp_high_factor;
+    }
+};
+
+/// Fragmentation statistics of a mobility type.
+pub const MobilityStats = struct {
+    /// Number of free blocks of each rank.
+    free_blocks: [max_rank]usize = .{0} ** max_rank,
+    /// Number of pageblocks of the type.
+    pageblocks: usize = 0,
+    /// Number of allocations that took a block of another type.
+    fallbacks: usize = 0,
+};
+
+/// Per-CPU page lists statistics.
+/// Can be used to tune the batch sizes.
+pub const CpuStats = struct {
+    /// Number of allocations satisfied from the per-CPU lists.
+    hits: usize = 0,
+    /// Number of the per-CPU lists refills from the buddy lists.
+    refills: usize = 0,
+    /// Number of the per-CPU lists drains into the buddy lists.
+    drains: usize = 0,
+};
 
 const max_areas = 14;
 
 pub const max_rank = max_areas;
 pub const max_alloc_pages = 1 << (max_rank - 1);
 
-var free_areas: [max_areas]FreeArea = .{FreeArea{}} ** max_areas;
+/// Maximum rank of blocks cached in the per-CPU lists.
+pub const pcp_max_rank = 3;
+const pcp_ranks = pcp_max_rank + 1;
+/// Batch size for the rank zero, halved for each next rank.
+const pcp_max_batch = 32;
+/// Ratio between the per-CPU list limit and batch size.
+const pcp_high_factor = 4;
+
+/// Maximum rank of blocks kept in the pre-zeroed pool.
+pub const zeroed_max_rank = pcp_max_rank;
+const zeroed_ranks = zeroed_max_rank + 1;
+/// Number of rank zero blocks in the pre-zeroed pool of each node,
+/// halved for each next rank.
+const zeroed_max_blocks = 64;
+/// Ratio between the pool limit and the low watermark waking up the filler.
+const zeroed_low_factor = 4;
+
+/// Rank of the pageblock, the unit of the mobility grouping (2 MiB).
+pub const pageblock_rank = 9;
+const pageblock_pages = 1 << pageblock_rank;
+
+/// Minimum rank of a failed allocation to run the compaction.
+pub const compact_min_rank = 9;
+/// Maximum number of regions processed by one compaction pass.
+const compact_max_regions = 4;
+
+/// Number of pages of each node available right after initialization.
+const bootstrap_pages = (256 * utils.mb_size) / vm.page_size;
+/// Maximum number of pages added to the buddy lists at once by `initDeferred`.
+const deferred_chunk_pages = max_alloc_pages * 8;
+
+/// Maximum number of the memory nodes.
+pub const max_nodes = 8;
+/// Maximum number of the SRAT memory ranges.
+const max_ranges = 32;
+
+const RangeArray = std.BoundedArray(Range, max_ranges);
+
+var nodes: [max_nodes]MemNode = .{MemNode{}} ** max_nodes;
+var nodes_num: u8 = 0;
+var ranges = RangeArray.init(0) catch unreachable;
+
+/// Node index of each CPU by it's APIC id.
+var apic_nodes: [256]u8 = .{0} ** 256;
+
+var cpu_caches: []CpuCache = &.{};
+
+var mobility_fallbacks: [mobility_num]usize = .{0} ** mobility_num;
+
+var deferred_list = DeferredList{};
+var deferred_lock = Spinlock.init(.unlocked);
+/// Number of pages not yet added to the buddy lists.
+var deferred_pages: usize = 0;
+/// Timestamp of the initialization beginning.
+var init_begin: usize = 0;
 
 export var allocated_pages: u32 = 0;
 export var total_pages: usize = 0;
 
-var lock = Spinlock.init(.unlocked);
+var movers = MoverList{};
+var movers_lock = Spinlock.init(.unlocked);
+
+var compact_lock = Spinlock.init(.unlocked);
+var compact_stats = CompactStats{};
+var isolated_list = IsolatedList{};
+var isolated_pages: u32 = 0;
 
 var is_init = false;
 
@@ -66,20 +678,16 @@ var is_init = false;
 /// 
 /// This function should be called only once.
 pub fn init() vm.Error!void {
-    const mem_map = boot.getMemMap();
-    const max_pages = mem_map.maxPage() + 1;
-
-    const bitmap_size = math.divCeil(u32, max_pages, utils.byte_size) catch unreachable;
-    const bitmap_pages = math.divCeil(u32, bitmap_size, vm.page_size) catch unreachable;
+    init_begin = utils.profileBegin();
 
-    const mem_pool = boot.alloc(bitmap_pages) orelse return vm.Error.NoMemory;
-    const virt_pool = vm.getVirtLma(mem_pool);
+    initNodes();
 
-    log.warn("mem pool size: {} KB", .{@as(usize, bitmap_pages) * (vm.page_size / utils.kb_size)});
+    const caches_pages = try initCpuCaches();
+    const bitmaps_pages = try initAreas();
 
-    initAreas(virt_pool, bitmap_size);
+    log.warn("mem pool size: {} KB", .{@as(usize, bitmaps_pages) * (vm.page_size / utils.kb_size)});
 
-    allocated_pages += bitmap_pages;
+    allocated_pages += bitmaps_pages + caches_pages;
     allocated_pages += @truncate(
         (@intFromPtr(vm.kernel_end) - @intFromPtr(vm.kernel_start)) /
         vm.page_size
@@ -91,121 +699,365 @@ pub fn init() vm.Error!void {
         log.warn("total mem: {} KB ({} MB)", .{ total_kb, total_kb / utils.kb_size });
     }
 
+    if (deferred_pages > 0) {
+        const deferred_mb = deferred_pages * vm.page_size / utils.mb_size;
+        log.warn("deferred mem: {} MB", .{deferred_mb});
+    }
+
+    if (nodes_num > 1) {
+        for (nodes[0..nodes_num], 0..) |*node, i| {
+            const node_mb = node.pages * vm.page_size / utils.mb_size;
+            log.warn("node {}: domain {}, {} MB", .{ i, node.domain, node_mb });
+        }
+    }
+
+    initCpu();
+
     is_init = true;
 }
 
-/// Allocates a linear block of physical memory of the specified rank (size).
+/// Binds the current CPU to the nearest memory node.
+/// Must be called on each CPU after it's local data setup
+/// and before the first allocation.
+pub fn initCpu() void {
+    const cpu_idx = smp.getIdx();
+    const apic_id = smp.getLocalData().arch_specific.apic_id;
+
+    cpu_caches[cpu_idx].node = apic_nodes[apic_id];
+}
+
+/// Allocates a linear block of unmovable physical memory of the specified rank (size).
+/// The memory is allocated from the node local to the current CPU if possible.
 /// 
 /// - `rank`: Determines the number of pages as `2^rank`.
 /// - Returns: The physical address of the allocated pages, or `null` if allocation fails.
-pub fn alloc(rank: u32) ?usize {
+pub inline fn alloc(rank: u32) ?usize {
+    return allocEx(rank, .unmovable);
+}
+
+/// Allocates a linear block of physical memory of the specified rank (size)
+/// and mobility type. The memory is allocated from the node local
+/// to the current CPU if possible.
+/// 
+/// - `rank`: Determines the number of pages as `2^rank`.
+/// - `mobility`: Mobility type of the allocation.
+/// - Returns: The physical address of the allocated pages, or `null` if allocation fails.
+pub fn allocEx(rank: u32, mobility: Mobility) ?usize {
     std.debug.assert(rank < max_rank);
 
-    lock.lock();
-    defer lock.unlock();
+    const cache = &cpu_caches[smp.getIdx()];
 
-    var free_entry = free_areas[rank].list.popFirst();
+    const result = blk: {
+        if (rank <= pcp_max_rank) {
+            if (allocCached(cache, rank, mobility)) |phys| break :blk phys;
+        }
 
-    if (free_entry == null) {
-        var temp_rank = rank + 1;
+        break :blk allocNearest(cache.node, rank, mobility);
+    };
+    const phys = result orelse {
+        if (pushDeferredChunk()) return allocEx(rank, mobility);
+        // Blocks cached by the local CPU may be coalesced into the required one.
+        if (drainLocal() + drainZeroed(cache.node) > 0) return allocEx(rank, mobility);
+        if (rank >= compact_min_rank and compact(rank) > 0) return allocEx(rank, mobility);
+        return null;
+    };
+
+    _ = @atomicRmw(u32, &allocated_pages, .Add, @as(u32, 1) << @truncate(rank), .monotonic);
+    return phys;
+}
 
-        while (temp_rank < max_areas) : (temp_rank += 1) {
-            if (free_areas[temp_rank].list.first) |entry| {
-                free_entry = entry;
-                break;
-            }
-        }
+/// Frees a physical memory of the specified rank (size).
+/// 
+/// - `base`: Physical address of the first page of a linear block returned from `alloc`.
+/// - `rank`: Determines the number of pages as `2^rank`,
+/// must be the same as in `alloc` call.
+pub fn free(base: usize, rank: u32) void {
+    std.debug.assert((base % vm.page_size) == 0 and rank < max_rank);
 
-        const entry = free_entry orelse return null;
+    _ = @atomicRmw(u32, &allocated_pages, .Sub, @as(u32, 1) << @truncate(rank), .monotonic);
 
-        var temp_pages: u32 = @as(u32, 1) << @truncate((temp_rank - 1));
-        var temp_base: u32 = entGetBase(entry);
+    const page: u32 = @truncate(base / vm.page_size);
+    const node_idx = getNodeIdx(page);
 
-        const node = free_areas[temp_rank].list.popFirst().?;
-        free_areas[temp_rank - 1].list.prepend(node);
+    if (rank <= pcp_max_rank) {
+        const cache = &cpu_caches[smp.getIdx()];
 
-        clearPageBit(temp_base, temp_rank);
-        setPageBit(temp_base, temp_rank - 1);
+        // Remote blocks go directly to their node.
+        if (cache.node == node_idx) return freeCached(cache, base, rank);
+    }
 
-        temp_rank -= 1;
-        temp_base += temp_pages;
+    nodes[node_idx].freeLocked(page, rank);
+}
 
-        while (temp_rank > rank) {
-            temp_rank -= 1;
-            temp_pages >>= 1;
+/// Allocates a linear block of unmovable physical memory of exactly `pages` pages.
+/// The block is allocated by the rank rounded up and the unused tail pages
+/// are returned to the buddy lists immediately.
+/// 
+/// - `pages`: Number of pages, must be in range `1..max_alloc_pages`.
+/// - Returns: The physical address of the allocated pages, or `null` if allocation fails.
+pub fn allocExact(pages: u32) ?usize {
+    std.debug.assert(pages > 0 and pages <= max_alloc_pages);
 
-            const new_node = makeNode(temp_base);
+    const rank = math.log2_int_ceil(u32, pages);
+    const phys = alloc(rank) orelse return null;
 
-            free_areas[temp_rank].list.prepend(new_node);
-            setPageBit(temp_base, temp_rank);
+    const tail_pages = (@as(u32, 1) << @truncate(rank)) - pages;
+    if (tail_pages == 0) return phys;
 
-            temp_base += temp_pages;
-        }
+    const page: u32 = @truncate(phys / vm.page_size);
+
+    _ = @atomicRmw(u32, &allocated_pages, .Sub, tail_pages, .monotonic);
+    nodes[getNodeIdx(page)].freeRange(page + pages, tail_pages);
+
+    return phys;
+}
 
-        allocated_pages += @as(u32, 1) << @truncate(rank);
-        return @as(usize, temp_base) * vm.page_size;
+/// Frees a physical memory allocated with `allocExact`.
+/// 
+/// - `base`: Physical address of the first page returned from `allocExact`.
+/// - `pages`: Number of pages, must be the same as in `allocExact` call.
+pub fn freeExact(base: usize, pages: u32) void {
+    std.debug.assert((base % vm.page_size) == 0 and pages > 0 and pages <= max_alloc_pages);
+
+    const page: u32 = @truncate(base / vm.page_size);
+
+    _ = @atomicRmw(u32, &allocated_pages, .Sub, pages, .monotonic);
+    nodes[getNodeIdx(page)].freeRange(page, pages);
+}
+
+/// Allocates a zeroed linear block of unmovable physical memory of the specified rank (size).
+/// Takes the block from the pre-zeroed pool of the local node first,
+/// otherwise zeroes it inline.
+/// 
+/// - `rank`: Determines the number of pages as `2^rank`.
+/// - Returns: The physical address of the allocated pages, or `null` if allocation fails.
+pub fn allocZeroed(rank: u32) ?usize {
+    if (rank <= zeroed_max_rank) {
+        const node = &nodes[cpu_caches[smp.getIdx()].node];
+
+        if (node.takeZeroed(rank)) |phys| {
+            _ = @atomicRmw(u32, &allocated_pages, .Add, @as(u32, 1) << @truncate(rank), .monotonic);
+            return phys;
+        }
     }
 
-    const entry = free_entry.?;
-    togglePageBit(entGetBase(entry), rank);
+    const phys = alloc(rank) orelse return null;
+    const size = vm.page_size << @truncate(rank);
 
-    allocated_pages += @as(u32, 1) << @truncate(rank);
-    return entGetPhys(entry);
+    @memset(@as([*]u8, @ptrFromInt(vm.getVirtLma(phys)))[0..size], 0);
+
+    return phys;
 }
 
-/// Frees a physical memory of the specified rank (size).
+/// Tops up the pre-zeroed pool of the node local to the current CPU.
+/// Intended to be called by idle CPUs.
 /// 
-/// - `base`: Physical address of the first page of a linear block returned from `alloc`.
-/// - `rank`: Determines the number of pages as `2^rank`,
-/// must be the same as in `alloc` call.
-pub fn free(base: usize, rank: u32) void {
-    std.debug.assert((base % vm.page_size) == 0 and rank < max_rank);
+/// - Returns: `true` if any block was zeroed, `false` if the pool is full
+/// or there is no free memory.
+pub fn fillZeroed() bool {
+    const node = &nodes[cpu_caches[smp.getIdx()].node];
+    var is_filled = false;
+
+    for (0..zeroed_ranks) |i| {
+        const rank: u32 = @truncate(i);
+
+        while (!node.isZeroedFull(rank)) {
+            const phys = node.allocLocked(rank, .unmovable) orelse return is_filled;
 
-    var page_base: u32 = @truncate(base / vm.page_size);
+            vm.zeroPages(vm.getVirtLma(phys), @as(u32, 1) << @truncate(rank));
+            node.putZeroed(phys, rank);
 
-    lock.lock();
-    defer lock.unlock();
+            is_filled = true;
+        }
+    }
+
+    return is_filled;
+}
 
-    defer allocated_pages -= @as(u32, 1) << @truncate(rank);
+/// Halts the idle CPU until the pre-zeroed pool of its node drops below
+/// the low watermark (see `allocZeroed`) or another interrupt arrives.
+/// Only one CPU per node is woken up, the others just wait for the next interrupt.
+pub fn waitZeroed() void {
+    const cpu_idx = smp.getIdx();
+    const node = &nodes[cpu_caches[cpu_idx].node];
 
-    if (getPageBit(page_base, rank) == 0 or rank == max_rank - 1) {
-        const entry = makeNode(page_base);
-        free_areas[rank].list.prepend(entry);
+    // The wake up IPI sent after the registration stays pending until the halt
+    _ = intr.saveAndDisableForCpu();
+    _ = node.zeroed_filler.cmpxchgStrong(0, cpu_idx + 1, .acq_rel, .monotonic);
 
-        setPageBit(page_base, rank);
-        return;
+    intr.waitForCpu();
+}
+
+/// Allocates multiple blocks of the same rank (size).
+/// Takes the node lock once for the whole batch instead of once per block,
+/// higher rank blocks are split as needed. Blocks are not contiguous.
+/// 
+/// - `rank`: Determines the number of pages in each block as `2^rank`.
+/// - `mobility`: Mobility type of the blocks.
+/// - `out`: Buffer for the physical addresses of the blocks,
+/// it's length is the number of blocks to allocate.
+/// - Returns: The number of allocated blocks, less than `out.len` if there is not enough memory.
+pub fn allocBatch(rank: u32, mobility: Mobility, out: []usize) u32 {
+    std.debug.assert(rank < max_rank);
+
+    const node_idx = cpu_caches[smp.getIdx()].node;
+    var count = allocNearestBatch(node_idx, rank, mobility, out);
+
+    while (count < out.len and pushDeferredChunk()) {
+        count += allocNearestBatch(node_idx, rank, mobility, out[count..]);
+    }
+    if (count < out.len and drainLocal() > 0) {
+        count += allocNearestBatch(node_idx, rank, mobility, out[count..]);
     }
 
-    var temp_rank = rank;
+    _ = @atomicRmw(u32, &allocated_pages, .Add, count << @truncate(rank), .monotonic);
+    return count;
+}
+
+/// Frees multiple blocks of the same rank (size) allocated with `alloc` or `allocBatch`.
+/// Takes the node lock once for the consecutive blocks of the same node.
+/// 
+/// - `blocks`: Physical addresses of the blocks.
+/// - `rank`: Determines the number of pages in each block as `2^rank`.
+pub fn freeBatch(blocks: []const usize, rank: u32) void {
+    std.debug.assert(rank < max_rank);
 
-    while (getPageBit(page_base, temp_rank) != 0 and temp_rank < max_rank - 1) {
-        const rank_pages = @as(u32, 1) << @truncate(temp_rank);
+    var begin: usize = 0;
 
-        var combine_base = page_base;
-        var buddy_base = page_base;
+    while (begin < blocks.len) {
+        const node_idx = getNodeIdx(@truncate(blocks[begin] / vm.page_size));
+        var end = begin + 1;
 
-        if (page_base % (rank_pages << 1) == 0) {
-            buddy_base += rank_pages;
-        } else {
-            buddy_base -= rank_pages;
-            combine_base = buddy_base;
+        while (end < blocks.len and getNodeIdx(@truncate(blocks[end] / vm.page_size)) == node_idx) {
+            end += 1;
         }
 
-        clearPageBit(buddy_base, temp_rank);
+        nodes[node_idx].freeBlocks(blocks[begin..end], rank);
+        begin = end;
+    }
+
+    const pages: u32 = @truncate(blocks.len << @truncate(rank));
+    _ = @atomicRmw(u32, &allocated_pages, .Sub, pages, .monotonic);
+}
+
+/// Adds the memory deferred at initialization to the buddy lists.
+/// Called by each AP after `smp.initAll`, the memory is split into chunks,
+/// so all CPUs can take part in it.
+pub fn initDeferred() void {
+    while (pushDeferredChunk()) {}
+}
+
+/// Migrates movable blocks to rebuild free blocks of the specified rank
+/// in the node local to the current CPU.
+/// Does nothing if the compaction is already running on another CPU.
+/// 
+/// - `rank`: Rank of the blocks to recover.
+/// - Returns: The number of recovered blocks.
+pub fn compact(rank: u32) u32 {
+    std.debug.assert(rank > 0 and rank < max_rank);
+
+    if (!compact_lock.tryLock()) return 0;
+    defer compact_lock.unlock();
 
-        const list = &free_areas[temp_rank].list;
-        const entry = getNode(buddy_base);
+    // Local cached blocks may be placed in the regions.
+    _ = drainLocal();
 
-        list.remove(entry);
+    const node = &nodes[cpu_caches[smp.getIdx()].node];
+    var tried: [compact_max_regions]u32 = undefined;
+    var recovered: u32 = 0;
 
-        page_base = combine_base;
-        temp_rank += 1;
+    for (0..compact_max_regions) |i| {
+        const region = node.findCompactRegion(rank, tried[0..i]) orelse break;
+        tried[i] = region;
+
+        if (compactRegion(node, region, rank)) recovered += 1;
     }
 
-    const new_node = makeNode(page_base);
-    free_areas[temp_rank].list.prepend(new_node);
+    compact_stats.runs += 1;
+    compact_stats.recovered += recovered;
+
+    log.info("compaction: {} blocks of rank {} recovered", .{ recovered, rank });
+
+    return recovered;
+}
+
+/// Moves the block contents to a new block.
+/// Can be used only by movers during the compaction, the old block
+/// is released by the compaction after all movers finish.
+/// 
+/// - `phys`: Physical address of the block to migrate.
+/// - `rank`: Rank of the block.
+/// - Returns: The physical address of the new block, or `null` if there is no memory.
+pub fn migrate(phys: usize, rank: u32) ?usize {
+    std.debug.assert(compact_lock.isLocked());
+
+    const new_phys = allocEx(rank, .movable) orelse return null;
+    const size = vm.page_size << @truncate(rank);
+
+    const dest: [*]u8 = @ptrFromInt(vm.getVirtLma(new_phys));
+    const src: [*]const u8 = @ptrFromInt(vm.getVirtLma(phys));
+
+    @memcpy(dest[0..size], src[0..size]);
+
+    _ = @atomicRmw(u32, &allocated_pages, .Sub, @as(u32, 1) << @truncate(rank), .monotonic);
+    isolateBlock(@truncate(phys / vm.page_size), rank);
+
+    compact_stats.migrated += 1;
+
+    return new_phys;
+}
+
+/// Registers an owner of movable blocks for the compaction.
+pub fn registerMover(mover: *Mover) void {
+    movers_lock.lock();
+    defer movers_lock.unlock();
+
+    movers.append(mover);
+}
+
+/// Unregisters an owner of movable blocks.
+pub fn unregisterMover(mover: *Mover) void {
+    movers_lock.lock();
+    defer movers_lock.unlock();
+
+    movers.remove(mover);
+}
 
-    setPageBit(page_base, temp_rank);
+/// Returns the compaction statistics.
+pub inline fn getCompactStats() *const CompactStats {
+    return &compact_stats;
+}
+
+/// Returns per-CPU lists statistics of the specific CPU.
+/// 
+/// - `cpu_idx`: Index of the CPU.
+pub inline fn getCpuStats(cpu_idx: u16) *const CpuStats {
+    return &cpu_caches[cpu_idx].stats;
+}
+
+/// Returns all blocks cached by the current CPU back to the buddy lists.
+/// 
+/// - Returns: The number of pages returned.
+pub fn drainLocal() u32 {
+    const cache = &cpu_caches[smp.getIdx()];
+    const node = &nodes[cache.node];
+    var pages: u32 = 0;
+
+    const intr_state = node.lockIntr();
+    defer node.unlockIntr(intr_state);
+
+    for (&cache.lists) |*lists| {
+        for (lists, 0..) |*list, rank| {
+            if (list.len == 0) continue;
+
+            pages += @as(u32, @truncate(list.len)) << @truncate(rank);
+            cache.stats.drains += 1;
+
+            while (list.pop()) |entry| node.freeBlock(cacheNodeGetBase(entry), @truncate(rank));
+        }
+    }
+
+    return pages;
 }
 
 /// Checks if the page allocator has been initialized.
@@ -225,58 +1077,486 @@ pub inline fn getAllocatedPages() u32 {
     return allocated_pages;
 }
 
-/// Initializes the free areas and bitmap based on the memory map.
+/// Collects the fragmentation statistics of the mobility type over all nodes.
+pub fn getMobilityStats(mobility: Mobility) MobilityStats {
+    const type_idx = @intFromEnum(mobility);
+    var stats = MobilityStats{ .fallbacks = mobility_fallbacks[type_idx] };
+
+    for (nodes[0..nodes_num]) |*node| {
+        const intr_state = node.lockIntr();
+        defer node.unlockIntr(intr_state);
+
+        for (node.free_areas, 0..) |*area, rank| {
+            stats.free_blocks[rank] += area.lists[type_idx].len;
+        }
+        for (node.pageblock_types) |pageblock_type| {
+            if (pageblock_type == mobility) stats.pageblocks += 1;
+        }
+    }
+
+    return stats;
+}
+
+/// Returns the number of memory nodes.
+pub inline fn getNodesNum() u8 {
+    return nodes_num;
+}
+
+/// Allocates a block from the nodes in order of the distance
+/// from the specified one.
+fn allocNearest(node_idx: u8, rank: u32, mobility: Mobility) ?usize {
+    const node = &nodes[node_idx];
+
+    for (node.fallback[0..node.fallback_len]) |idx| {
+        if (nodes[idx].allocLocked(rank, mobility)) |phys| return phys;
+    }
+
+    return null;
+}
+
+/// Compacts the aligned region of `2^rank` pages.
+/// Free blocks of the region are isolated first, so the migrated blocks
+/// can't be placed back into the region.
+/// 
+/// - Returns: `true` if the whole region became free.
+fn compactRegion(node: *MemNode, region: u32, rank: u32) bool {
+    const end = region + (@as(u32, 1) << @truncate(rank));
+
+    isolated_pages = 0;
+    node.isolateFree(region, end, rank);
+
+    {
+        movers_lock.lock();
+        defer movers_lock.unlock();
+
+        var mover = movers.first;
+
+        while (mover) |m| : (mover = m.next) {
+            _ = m.data(m, region, end);
+        }
+    }
+
+    const is_recovered = isolated_pages == end - region;
+
+    while (isolated_list.popFirst()) |entry| {
+        const base: u32 = @truncate(vm.getPhysLma(@intFromPtr(entry)) / vm.page_size);
+        nodes[getNodeIdx(base)].freeLocked(base, entry.data);
+    }
+
+    return is_recovered;
+}
+
+/// Puts the block into the isolated list.
+fn isolateBlock(base: u32, rank: u32) void {
+    const entry: *IsolatedList.Node = @ptrFromInt(vm.getVirtLma(@as(usize, base) * vm.page_size));
+    entry.data = @truncate(rank);
+
+    isolated_list.prepend(entry);
+    isolated_pages += @as(u32, 1) << @truncate(rank);
+}
+
+/// Returns the pre-zeroed pool blocks of the node back to the buddy lists.
+/// 
+/// - Returns: The number of pages returned.
+fn drainZeroed(node_idx: u8) u32 {
+    const node = &nodes[node_idx];
+    var pages: u32 = 0;
+
+    const intr_state = node.lockZeroed();
+    defer node.unlockZeroed(intr_state);
+
+    for (&node.zeroed, 0..) |*list, i| {
+        const rank: u32 = @truncate(i);
+
+        while (list.popFirst()) |entry| {
+            node.freeLocked(@truncate(zeroedNodeGetPhys(entry) / vm.page_size), rank);
+            pages += @as(u32, 1) << @truncate(rank);
+        }
+    }
+
+    return pages;
+}
+
+inline fn zeroedHighOf(rank: u32) u32 {
+    return zeroed_max_blocks >> @truncate(rank);
+}
+
+inline fn zeroedLowOf(rank: u32) u32 {
+    return zeroedHighOf(rank) / zeroed_low_factor;
+}
+
+/// Takes a chunk from the deferred ranges and adds it to the buddy lists.
+/// 
+/// - Returns: `true` if a chunk was added, `false` if there is nothing left.
+fn pushDeferredChunk() bool {
+    var base: u32 = undefined;
+    var pages: u32 = undefined;
+    var node_idx: u8 = undefined;
+
+    {
+        deferred_lock.lock();
+        defer deferred_lock.unlock();
+
+        const range = deferred_list.popFirst() orelse return false;
+
+        base = deferredGetBase(range);
+        pages = @min(range.data.pages, deferred_chunk_pages);
+        node_idx = range.data.node;
+
+        if (pages < range.data.pages) {
+            const rest = makeDeferred(base + pages, range.data.pages - pages, node_idx);
+            deferred_list.prepend(rest);
+        }
+    }
+
+    nodes[node_idx].pushFreeLocked(base, pages);
+
+    const left = @atomicRmw(usize, &deferred_pages, .Sub, pages, .acq_rel) - pages;
+
+    if (left == 0) {
+        const total_mb = total_pages * vm.page_size / utils.mb_size;
+        log.warn("{} MB initialized in {} cycles", .{ total_mb, utils.profileEnd(init_begin) });
+    }
+
+    return true;
+}
+
+/// Allocates blocks from the nodes in order of the distance
+/// from the specified one.
+fn allocNearestBatch(node_idx: u8, rank: u32, mobility: Mobility, out: []usize) u32 {
+    const node = &nodes[node_idx];
+    var count: u32 = 0;
+
+    for (node.fallback[0..node.fallback_len]) |idx| {
+        if (count == out.len) break;
+
+        count += nodes[idx].allocBlocks(rank, mobility, out[count..]);
+    }
+
+    return count;
+}
+
+/// Allocates a block from the per-CPU list,
+/// refilling the list from the local node if it is empty.
+fn allocCached(cache: *CpuCache, rank: u32, mobility: Mobility) ?usize {
+    const intr_state = intr.saveAndDisableForCpu();
+    defer intr.restoreForCpu(intr_state);
+
+    const list = &cache.lists[@intFromEnum(mobility)][rank];
+
+    if (list.popFirst()) |entry| {
+        cache.stats.hits += 1;
+        return cacheNodeGetPhys(entry);
+    }
+
+    cache.stats.refills += 1;
+
+    var batch: [pcp_max_batch]usize = undefined;
+    const count = nodes[cache.node].allocBlocks(rank, mobility, batch[0..CpuCache.batchOf(rank)]);
+
+    for (batch[0..count]) |phys| list.append(makeCacheNode(phys));
+
+    const entry = list.popFirst() orelse return null;
+    return cacheNodeGetPhys(entry);
+}
+
+/// Puts a block into the per-CPU list of it's pageblock mobility type.
+/// Drains the coldest blocks to the buddy lists if the list is full.
+fn freeCached(cache: *CpuCache, base: usize, rank: u32) void {
+    const intr_state = intr.saveAndDisableForCpu();
+    defer intr.restoreForCpu(intr_state);
+
+    const node = &nodes[cache.node];
+    const mobility = node.getPageblockType(@truncate(base / vm.page_size));
+    const list = &cache.lists[@intFromEnum(mobility)][rank];
+
+    list.prepend(makeCacheNode(base));
+
+    if (list.len <= CpuCache.highOf(rank)) return;
+
+    cache.stats.drains += 1;
+
+    var batch: [pcp_max_batch]usize = undefined;
+    var count: u32 = 0;
+
+    while (count < CpuCache.batchOf(rank)) : (count += 1) {
+        const entry = list.pop() orelse break;
+        batch[count] = cacheNodeGetPhys(entry);
+    }
+
+    node.freeBlocks(batch[0..count], rank);
+}
+
+/// Returns the index of the node the page belongs to.
+/// Pages not described by SRAT belong to the first node.
+fn getNodeIdx(page: u32) u8 {
+    for (ranges.constSlice()) |range| {
+        if (page >= range.base and page < range.end) return range.node;
+    }
+
+    return 0;
+}
+
+/// Returns the part of the pages range `[page, end)` that belongs
+/// to the same node as the first page.
+fn getNodePart(page: u32, end: u32) struct { end: u32, node: u8 } {
+    var part_end = end;
+
+    for (ranges.constSlice()) |range| {
+        if (page >= range.base and page < range.end) {
+            return .{ .end = @min(end, range.end), .node = range.node };
+        }
+
+        if (range.base > page) part_end = @min(part_end, range.base);
+    }
+
+    return .{ .end = part_end, .node = 0 };
+}
+
+/// Looks up an ACPI table used to detect the memory nodes.
+fn findTable(comptime T: type, signature: *const [4:0]u8) ?*T {
+    acpi.preinit() catch return null;
+
+    const header = acpi.findEntry(signature) orelse return null;
+
+    if (!header.checkSum()) {
+        log.err("{s} checksum failed", .{signature});
+        return null;
+    }
+
+    return @ptrCast(header);
+}
+
+/// Detects the memory nodes and their distances using ACPI SRAT and SLIT.
+/// Uses a single node if the tables are not available.
+fn initNodes() void {
+    const srat = findTable(acpi.Srat, "SRAT");
+    const slit = findTable(acpi.Slit, "SLIT");
+
+    if (srat) |table| initSratNodes(table);
+    if (nodes_num == 0) nodes_num = 1;
+
+    // Order nodes by the distance for each node
+    for (nodes[0..nodes_num], 0..) |*node, node_idx| {
+        for (0..nodes_num) |i| {
+            const idx: u8 = @truncate(i);
+            const distance = getDistance(slit, node_idx, idx);
+
+            var pos = node.fallback_len;
+            while (pos > 0 and getDistance(slit, node_idx, node.fallback[pos - 1]) > distance) : (pos -= 1) {
+                node.fallback[pos] = node.fallback[pos - 1];
+            }
+
+            node.fallback[pos] = idx;
+            node.fallback_len += 1;
+        }
+    }
+
+    if (srat) |table| initCpuNodes(table, slit);
+}
+
+/// Creates a node for each proximity domain with memory.
+fn initSratNodes(srat: *acpi.Srat) void {
+    const Memory = acpi.Srat.Memory;
+
+    var entry = srat.findByType(null, .memory);
+
+    while (entry) |ent| : (entry = srat.findByType(ent, .memory)) {
+        const mem: *const Memory = @ptrCast(ent);
+
+        if (mem.flags & Memory.enabled_flag == 0 or mem.getLength() == 0) continue;
+
+        const node_idx = getNodeByDomain(mem.domain) orelse blk: {
+            if (nodes_num == max_nodes) {
+                log.warn("too many memory nodes, domain {} is ignored", .{mem.domain});
+                continue;
+            }
+
+            nodes[nodes_num].domain = mem.domain;
+            nodes_num += 1;
+
+            break :blk nodes_num - 1;
+        };
+
+        ranges.append(.{
+            .base = @truncate(mem.getBase() / vm.page_size),
+            .end = @truncate((mem.getBase() + mem.getLength()) / vm.page_size),
+            .node = node_idx
+        }) catch {
+            log.warn("too many memory ranges, the rest belongs to node 0", .{});
+            return;
+        };
+    }
+}
+
+/// Binds each processor described in SRAT to the nearest node.
+fn initCpuNodes(srat: *acpi.Srat, slit: ?*acpi.Slit) void {
+    const ProcLapic = acpi.Srat.ProcLapic;
+    const ProcX2apic = acpi.Srat.ProcX2apic;
+
+    var entry = srat.findByType(null, .proc_lapic);
+
+    while (entry) |ent| : (entry = srat.findByType(ent, .proc_lapic)) {
+        const proc: *const ProcLapic = @ptrCast(ent);
+        if (proc.flags & ProcLapic.enabled_flag == 0) continue;
+
+        apic_nodes[proc.apic_id] = getNearestNode(slit, proc.getDomain());
+    }
+
+    entry = srat.findByType(null, .proc_x2apic);
+
+    while (entry) |ent| : (entry = srat.findByType(ent, .proc_x2apic)) {
+        const proc: *const ProcX2apic = @ptrCast(ent);
+        if (proc.flags & ProcX2apic.enabled_flag == 0 or proc.x2apic_id >= apic_nodes.len) continue;
+
+        apic_nodes[proc.x2apic_id] = getNearestNode(slit, proc.domain);
+    }
+}
+
+fn getNodeByDomain(domain: u32) ?u8 {
+    for (nodes[0..nodes_num], 0..) |*node, i| {
+        if (node.domain == domain) return @truncate(i);
+    }
+
+    return null;
+}
+
+/// Returns the node nearest to the proximity domain,
+/// used for the domains without memory.
+fn getNearestNode(slit: ?*acpi.Slit, domain: u32) u8 {
+    if (getNodeByDomain(domain)) |idx| return idx;
+
+    var result: u8 = 0;
+    var min_distance: u8 = math.maxInt(u8);
+
+    for (nodes[0..nodes_num], 0..) |*node, i| {
+        const distance = if (slit) |table| table.getDistance(domain, node.domain) else acpi.Slit.remote_distance;
+
+        if (distance < min_distance) {
+            min_distance = distance;
+            result = @truncate(i);
+        }
+    }
+
+    return result;
+}
+
+/// Returns the relative distance between two nodes.
+/// The node is always the nearest to itself.
+fn getDistance(slit: ?*acpi.Slit, from: usize, to: usize) u8 {
+    if (from == to) return 0;
+
+    const table = slit orelse return acpi.Slit.remote_distance;
+    return table.getDistance(nodes[from].domain, nodes[to].domain);
+}
+
+/// Allocates and initializes the per-CPU lists for each CPU.
+/// 
+/// - Returns: The number of pages used for the lists.
+fn initCpuCaches() vm.Error!u32 {
+    const cpus_num = smp.getNum();
+    const pool_size = @as(u32, cpus_num) * @sizeOf(CpuCache);
+    const pool_pages = math.divCeil(u32, pool_size, vm.page_size) catch unreachable;
+
+    const pool = boot.alloc(pool_pages) orelse return vm.Error.NoMemory;
+
+    cpu_caches.ptr = @ptrFromInt(vm.getVirtLma(pool));
+    cpu_caches.len = cpus_num;
+
+    @memset(cpu_caches, CpuCache{});
+
+    return pool_pages;
+}
+
+/// Initializes the nodes free areas and bitmaps based on the memory map.
 /// Sets up the bitmaps and populates the free areas with initial free nodes.
-fn initAreas(bitmap_base: usize, bitmap_size: u32) void {
+/// 
+/// - Returns: The number of pages used for the bitmaps.
+fn initAreas() vm.Error!u32 {
     const mem_map = boot.getMemMap();
 
-    var curr_bitmap_base = bitmap_base;
-    var curr_bitmap_size = bitmap_size / 2;
+    // Calculate the pages range of each node
+    for (mem_map.entries[0..mem_map.len]) |*entry| {
+        if (entry.type != .free) continue;
+
+        const end = entry.base + entry.pages;
+        var page = entry.base;
+
+        while (page < end) {
+            const part = getNodePart(page, end);
+            const node = &nodes[part.node];
+
+            node.base = @min(node.base, page);
+            node.end = @max(node.end, part.end);
+
+            page = part.end;
+        }
+    }
 
     // Initialize bitmaps
-    for (0..max_areas) |i| {
-        const bits: [*]u8 = @ptrFromInt(curr_bitmap_base);
-        free_areas[i].bitmap = utils.Bitmap.init(bits[0..curr_bitmap_size], true);
+    var bitmaps_pages: u32 = 0;
+
+    for (nodes[0..nodes_num]) |*node| {
+        if (node.isEmpty()) continue;
 
-        curr_bitmap_base += curr_bitmap_size;
-        curr_bitmap_size = @max((curr_bitmap_size >> 1) + (curr_bitmap_size & 1), 1);
+        node.base -= node.base % max_alloc_pages;
+        bitmaps_pages += try node.initBitmaps();
     }
 
+    // There is nobody to add the deferred memory in parallel
+    const bootstrap_limit: u32 = if (smp.getNum() > 1) bootstrap_pages else math.maxInt(u32);
+    var bootstrap_left: [max_nodes]u32 = .{bootstrap_limit} ** max_nodes;
+
     // Fill free lists
     for (mem_map.entries[0..mem_map.len]) |*entry| {
         if (entry.type != .free) continue;
 
-        pushFreeEntry(entry);
-    }
-}
+        const end = entry.base + entry.pages;
+        var page = entry.base;
 
-/// Adds a free memory entry to the appropriate free area list.
-/// Splits the memory if necessary to make all pages blocks aligned to
-/// it's size and updates the bitmap.
-fn pushFreeEntry(entry: *const boot.MemMap.Entry) void {
-    total_pages += entry.pages;
+        while (page < end) {
+            const part = getNodePart(page, end);
+            const node = &nodes[part.node];
 
-    var temp_base = entry.base;
-    var temp_pages = entry.pages;
+            const pages = part.end - page;
+            const now_pages = @min(pages, bootstrap_left[part.node]);
 
-    while (temp_pages != 0) {
-        var temp_rank: u32 = math.log2_int(u32, temp_pages);
+            if (now_pages > 0) node.pushFree(page, now_pages);
+            if (now_pages < pages) {
+                const range = makeDeferred(page + now_pages, pages - now_pages, part.node);
 
-        if (temp_rank >= max_rank) temp_rank = max_rank - 1;
+                deferred_list.prepend(range);
+                deferred_pages += range.data.pages;
+            }
 
-        var rank_pages_num: u32 = @as(u32, 1) << @truncate(temp_rank);
+            bootstrap_left[part.node] -= now_pages;
+            node.pages += pages;
 
-        while ((temp_base % rank_pages_num) != 0) {
-            temp_rank -= 1;
-            rank_pages_num >>= 1;
+            page = part.end;
         }
 
-        const node = makeNode(temp_base);
-        free_areas[temp_rank].list.prepend(node);
-
-        temp_base += rank_pages_num;
-        temp_pages -= rank_pages_num;
+        total_pages += entry.pages;
     }
+
+    return bitmaps_pages;
+}
+
+/// Places deferred range node at the first page of the range.
+inline fn makeDeferred(base: u32, pages: u32, node_idx: u8) *DeferredList.Node {
+    const range: *DeferredList.Node = @ptrFromInt(vm.getVirtLma(@as(usize, base) * vm.page_size));
+    range.data = .{ .pages = pages, .node = node_idx };
+
+    return range;
+}
+
+/// Gets the physical address of a pre-zeroed pool node.
+inline fn zeroedNodeGetPhys(node: *ZeroedList.Node) usize {
+    return vm.getPhysLma(@intFromPtr(node));
+}
+
+/// Gets the base page of a deferred range node.
+inline fn deferredGetBase(range: *DeferredList.Node) u32 {
+    return @truncate(vm.getPhysLma(@intFromPtr(range)) / vm.page_size);
 }
 
 /// Returns `FreeNode` related to the physical pages block located
@@ -299,6 +1579,23 @@ inline fn makeNode(phys_base: u32) *FreeNode {
     return node;
 }
 
+/// Returns per-CPU list node placed at the beginning of the block.
+/// 
+/// - `phys`: Physical address of the block.
+inline fn makeCacheNode(phys: usize) *CpuCache.Node {
+    return @ptrFromInt(vm.getVirtLma(phys));
+}
+
+/// Gets the physical address of a per-CPU list node.
+inline fn cacheNodeGetPhys(node: *CpuCache.Node) usize {
+    return vm.getPhysLma(@intFromPtr(node));
+}
+
+/// Gets the base page of a per-CPU list node.
+inline fn cacheNodeGetBase(node: *CpuCache.Node) u32 {
+    return @truncate(cacheNodeGetPhys(node) / vm.page_size);
+}
+
 /// Gets the base address of a free node.
 inline fn entGetBase(node: *FreeNode) u32 {
     return @truncate(entGetPhys(node) / vm.page_size);
@@ -310,19 +1607,3 @@ inline fn entGetBase(node: *FreeNode) u32 {
 inline fn entGetPhys(node: *FreeNode) usize {
     return vm.getPhysLma(@intFromPtr(node));
 }
-
-inline fn clearPageBit(base: u32, rank: u32) void {
-    free_areas[rank].bitmap.clear(base >> @truncate(1 + rank));
-}
-
-inline fn setPageBit(base: u32, rank: u32) void {
-    free_areas[rank].bitmap.set(base >> @truncate(1 + rank));
-}
-
-inline fn getPageBit(base: u32, rank: u32) u8 {
-    return free_areas[rank].bitmap.get(base >> @truncate(1 + rank));
-}
-
-inline fn togglePageBit(base: u32, rank: u32) void {
-    free_areas[rank].bitmap.toggle(base >> @truncate(1 + rank));
-}
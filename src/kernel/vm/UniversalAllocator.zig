@@ -26,14 +26,21 @@
 //! - For larger memory regions (anything larger than `max_small_size`).
 //! 
 //! Small allocations is managed by the pool of `vm.ObjectAllocator`s, where each allocator is determined
-//! for the specific object size. The number of allocators is defined in `oma_pool_len`. The object sizes
-//! specified for allocators in the pool are guaranteed to be power of two. This also means that
-//! calling `alloc` with a size that is not power of two results in fragmentation,since the provided size
-//! will be rounded up to the nearest power of two.
+//! for the specific object size (size class). The size classes are powers of two and the midpoints
+//! between them (16, 32, 48, 64, 96, 128, ...), see `size_classes`. The provided size is rounded up
+//! to the nearest class, which halves the worst case rounding compared to the powers of two alone.
+//! Objects are aligned at least to `min_size`. Objects of a midpoint class are aligned only to
+//! the lower power of two, so allocations with a bigger alignment take the next class that is
+//! a multiple of it (see `allocAligned`). All allocators in the pool use arenas of the same size
+//! (`oma_arena_rank`), so the owner of a small object is found in constant time on free.
+//! Each allocator holds back at most `oma_empty_arenas` empty arenas.
+//! 
+//! Requested and allocated bytes are counted per size class, see `getClassStats`.
 //! 
 //! Large allocations is implemented via `vm.PageAllocator`, a virtual DMA zone is used for the fast
-//! convertion from physical to virtual address and back. A binary tree is used to manage allocations
-//! and store the number of allocated pages for future deallocation.
+//! convertion from physical to virtual address and back. A red-black tree is used to manage allocations
+//! and store the number of allocated pages for future deallocation. Large allocations are not rounded
+//! up to the power of two, only to the page size (see `vm.PageAllocator.allocExact`).
 
 // Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
 
@@ -48,15 +55,50 @@ const max_small_size = vm.page_size / 2;
 /// The minimum size for any allocation.
 const min_size = 16;
 
+/// Object sizes of the small allocations: powers of two
+/// from `min_size` to `max_small_size` and the midpoints between them.
+pub const size_classes = initSizeClasses();
+
 /// The number of object allocators in the small object allocator pool, 
-const oma_pool_len = std.math.log2(max_small_size) - std.math.log2(min_size);
+const oma_pool_len = size_classes.len;
 /// The minimum number of objects that the object allocators can hold.
-const oma_min_capacity = 16;
+const oma_min_capacity = 4;
+/// Rank of the arenas of all object allocators in the pool,
+/// enough to hold `oma_min_capacity` objects of the largest size.
+/// The arena of an object is found by the address alignment, so the rank
+/// can't differ per class, it's kept as small as the largest class allows.
+const oma_arena_rank = std.math.log2_int_ceil(
+    u32, std.math.divCeil(u32, max_small_size * (oma_min_capacity + 1), vm.page_size) catch unreachable
+);
+
+/// Number of the empty arenas held back by each allocator in the pool.
+const oma_empty_arenas = 1;
+
+/// Index of the size class by the size rounded up to `min_size`.
+const class_table = initClassTable();
+
+/// Statistics of a size class.
+pub const ClassStats = struct {
+    /// Number of allocations.
+    allocs: usize = 0,
+    /// Number of frees.
+    frees: usize = 0,
+    /// Total requested bytes.
+    requested: usize = 0,
+    /// Total allocated bytes, including rounding up to the class size.
+    allocated: usize = 0,
+
+    /// Returns the percentage of the allocated bytes lost to rounding.
+    pub fn getWaste(self: *const ClassStats) u8 {
+        if (self.allocated == 0) return 0;
+        return @truncate(((self.allocated - self.requested) * 100) / self.allocated);
+    }
+};
 
 /// Represents a large memory block allocation.
 const HugeFrame = struct {
     base: u32 = undefined,
-    rank: u8 = undefined,
+    pages: u32 = undefined,
 
     pub fn cmp(lhs: *const HugeFrame, rhs: *const HugeFrame) utils.CmpResult {
         if (lhs.base == rhs.base) { return .equals; }
@@ -66,28 +108,46 @@ const HugeFrame = struct {
     }
 };
 
-const HugeTree = utils.BinaryTree(HugeFrame, HugeFrame.cmp);
+const HugeTree = utils.RbTree(HugeFrame, HugeFrame.cmp);
 const HugeNode = HugeTree.Node;
 
 /// A fixed-size array of object allocators (`vm.ObjectAllocator`),
 /// used for managing small memory blocks.
 var oma_pool: [oma_pool_len]vm.ObjectAllocator = init_oma_pool();
 
+/// Statistics of each size class, indices are the same as in `size_classes`.
+var class_stats: [oma_pool_len]ClassStats = .{ClassStats{}} ** oma_pool_len;
+
 /// An object allocator dedicated to managing nodes within the `HugeTree`.
 var huge_oma = vm.ObjectAllocator.init(HugeNode);
-/// The binary tree that manages all large memory block allocations.
+/// The red-black tree that manages all large memory block allocations.
 var huge_alloc_tree = HugeTree{};
 
-/// Allocates a block of memory of the specified `size`.
+/// Allocates a block of memory of the specified `size` aligned to `min_size`.
 /// 
 /// - `size`: The size of memory to allocate. Must be great than zero.
 /// Maximum size of the memory block is limited by `vm.PageAllocator.max_alloc_pages`.
 /// - Returns: A pointer to the allocated memory block,
 /// or `null` if the allocation fails.
 pub inline fn alloc(size: usize) ?*anyopaque {
+    return allocAligned(size, min_size);
+}
+
+/// Allocates a block of memory of the specified `size` and alignment.
+/// 
+/// - `size`: The size of memory to allocate. Must be great than zero.
+/// Maximum size of the memory block is limited by `vm.PageAllocator.max_alloc_pages`.
+/// - `alignment`: The alignment in bytes, a power of two up to `vm.page_size`.
+/// - Returns: A pointer to the allocated memory block,
+/// or `null` if the allocation fails.
+pub fn allocAligned(size: usize, alignment: usize) ?*anyopaque {
     std.debug.assert(size > 0 and size < (vm.PageAllocator.max_alloc_pages * vm.page_size));
+    std.debug.assert(std.math.isPowerOfTwo(alignment) and alignment <= vm.page_size);
 
-    return if (size <= max_small_size) allocSmall(@truncate(size)) else allocHuge(@truncate(size));
+    // Large blocks are aligned to the page size
+    if (size > max_small_size or alignment > max_small_size) return allocHuge(@truncate(size));
+
+    return allocSmall(@truncate(size), @truncate(alignment));
 }
 
 /// Frees a previously allocated block of memory pointed to by `mem`.
@@ -104,7 +164,7 @@ pub fn free(mem: ?*anyopaque) void {
         const base: u32 = @truncate(phys / vm.page_size);
 
         if (huge_alloc_tree.remove(HugeFrame{.base = base})) |node| {
-            vm.PageAllocator.free(phys, node.data.rank);
+            vm.PageAllocator.freeExact(phys, node.data.pages);
             huge_oma.free(node);
 
             return;
@@ -112,28 +172,103 @@ pub fn free(mem: ?*anyopaque) void {
     }
 
     // Dealloc small object
-    for (oma_pool[0..]) |*oma| {
-        if (oma.contains(addr)) |arena| {
-            oma.freeRaw(arena, addr);
-            return;
+    const arena = vm.ObjectAllocator.getArena(addr, oma_arena_rank);
+    const oma = arena.data.owner;
+
+    class_stats[getClass(oma)].frees += 1;
+
+    oma.freeRaw(arena, addr);
+}
+
+/// Tries to resize a previously allocated block of memory in place.
+/// 
+/// Succeeds if the new size still fits the size class of a small block,
+/// or the pages of a large block. Shrinking a large block returns
+/// the unused tail pages to the page allocator.
+/// 
+/// A small block resized in place is counted in the class statistics
+/// as freed and allocated again, the same as if it was reallocated.
+/// 
+/// - `mem`: A pointer to the memory block.
+/// - `new_size`: The new size of the block. Must be great than zero.
+/// - Returns: `true` if the block was resized, `false` if it must be reallocated.
+pub fn resize(mem: *anyopaque, new_size: usize) bool {
+    std.debug.assert(new_size > 0);
+
+    const addr: usize = @intFromPtr(mem);
+    const phys = vm.getPhysLma(addr);
+
+    if ((phys % vm.page_size) == 0) {
+        const base: u32 = @truncate(phys / vm.page_size);
+
+        if (huge_alloc_tree.find(HugeFrame{.base = base})) |node| {
+            const pages = std.math.divCeil(usize, new_size, vm.page_size) catch unreachable;
+            if (pages > node.data.pages) return false;
+
+            const tail_pages: u32 = node.data.pages - @as(u32, @truncate(pages));
+
+            if (tail_pages > 0) {
+                vm.PageAllocator.freeExact(phys + pages * vm.page_size, tail_pages);
+                node.data.pages -= tail_pages;
+            }
+
+            return true;
         }
     }
 
-    // The memory region is not managed by the allocator
-    // or address is damaged.
-    unreachable;
+    const arena = vm.ObjectAllocator.getArena(addr, oma_arena_rank);
+    const oma = arena.data.owner;
+
+    if (new_size > oma.obj_size) return false;
+
+    const class = getClass(oma);
+    const stats = &class_stats[class];
+
+    stats.frees += 1;
+    stats.allocs += 1;
+    stats.requested += new_size;
+    stats.allocated += size_classes[class];
+
+    return true;
+}
+
+/// Returns the statistics of each size class,
+/// indices are the same as in `size_classes`.
+pub inline fn getClassStats() []const ClassStats {
+    return &class_stats;
 }
 
 /// Allocates a small block of memory of the specified `size` using the appropriate object 
 /// allocator from the `oma_pool`.
 /// 
 /// - `size`: The size of the small memory block to allocate.
+/// - `alignment`: The alignment of the block, not greater than `max_small_size`.
 /// - Returns: A pointer to the allocated memory block, or `null` if the allocation fails.
-fn allocSmall(size: u32) ?*anyopaque {
-    const log2 = std.math.log2_int_ceil(u32, size);
-    const rank = if (size > min_size) log2 - comptime std.math.log2(min_size) else 0;
+fn allocSmall(size: u32, alignment: u32) ?*anyopaque {
+    var class = class_table[(size + min_size - 1) / min_size];
+    // Objects are placed at multiples of the class size from the arena base,
+    // take the first class that is a multiple of the alignment.
+    while (size_classes[class] % alignment != 0) class += 1;
+    const result = oma_pool[class].alloc(anyopaque) orelse return null;
+
+    const stats = &class_stats[class];
+    stats.allocs += 1;
+    stats.requested += size;
+    stats.allocated += size_classes[class];
 
-    return oma_pool[rank].alloc(anyopaque);
+    return result;
+}
+
+/// Returns the size class index of the allocator from the `oma_pool`.
+fn getClass(oma: *const vm.ObjectAllocator) usize {
+    // The memory region is not managed by the allocator
+    // or address is damaged.
+    std.debug.assert(
+        @intFromPtr(oma) >= @intFromPtr(&oma_pool[0]) and
+        @intFromPtr(oma) <= @intFromPtr(&oma_pool[oma_pool_len - 1])
+    );
+
+    return (@intFromPtr(oma) - @intFromPtr(&oma_pool[0])) / @sizeOf(vm.ObjectAllocator);
 }
 
 /// Allocates a large block of memory of the specified `size`.
@@ -148,16 +283,15 @@ fn allocHuge(size: u32) ?*anyopaque {
 
     if (pages > vm.PageAllocator.max_alloc_pages) return null;
 
-    const rank = std.math.log2_int_ceil(u32, pages);
-    const phys = vm.PageAllocator.alloc(rank) orelse return null;
+    const phys = vm.PageAllocator.allocExact(pages) orelse return null;
 
     const node = huge_oma.alloc(HugeNode) orelse {
-        vm.PageAllocator.free(phys, rank);
+        vm.PageAllocator.freeExact(phys, pages);
         return null;
     };
     node.* = HugeNode.init(.{
         .base = @truncate(phys / vm.page_size),
-        .rank = rank
+        .pages = pages
     });
 
     huge_alloc_tree.insert(node);
@@ -165,8 +299,7 @@ fn allocHuge(size: u32) ?*anyopaque {
     return @as(*anyopaque, @ptrFromInt(vm.getVirtLma(phys)));
 }
 
-/// Initializes the pool of small object allocators (`oma_pool`) based on the size range 
-/// from `min_size` to `max_small_size`.
+/// Initializes the pool of small object allocators (`oma_pool`) based on the `size_classes`.
 /// 
 /// This function is called only once in compile time.
 /// 
@@ -174,17 +307,58 @@ fn allocHuge(size: u32) ?*anyopaque {
 fn init_oma_pool() [oma_pool_len]vm.ObjectAllocator {
     var result: [oma_pool_len]vm.ObjectAllocator = undefined;
 
-    const min_rank = std.math.log2(min_size);
-    const max_rank = std.math.log2(max_small_size);
+    inline for (size_classes, 0..) |size, i| {
+        result[i] = vm.ObjectAllocator.initSizedEx(size, 1 << oma_arena_rank, .{ .empty_arenas = oma_empty_arenas });
+    }
+
+    return result;
+}
+
+/// Builds the size classes at compile time: each power of two
+/// is followed by the midpoint to the next one, if it's a multiple of `min_size`.
+fn initSizeClasses() [countSizeClasses()]u32 {
+    var result: [countSizeClasses()]u32 = undefined;
+    var i: usize = 0;
+    var size: u32 = min_size;
+
+    while (size <= max_small_size) : (size *= 2) {
+        result[i] = size;
+        i += 1;
+
+        const mid = size + size / 2;
+        if (mid < max_small_size and mid % min_size == 0) {
+            result[i] = mid;
+            i += 1;
+        }
+    }
+
+    return result;
+}
+
+fn countSizeClasses() usize {
+    var num: usize = 0;
+    var size: u32 = min_size;
+
+    while (size <= max_small_size) : (size *= 2) {
+        num += 1;
+
+        const mid = size + size / 2;
+        if (mid < max_small_size and mid % min_size == 0) num += 1;
+    }
+
+    return num;
+}
 
-    inline for (min_rank..max_rank) |rank| {
-        const size = @as(u32, 1) << @truncate(rank);
-        const i = rank - min_rank;
+/// Builds the table of size class indices at compile time.
+fn initClassTable() [max_small_size / min_size + 1]u8 {
+    var result: [max_small_size / min_size + 1]u8 = undefined;
+    var class: u8 = 0;
 
-        const pages_num = std.math.divCeil(u32, size * oma_min_capacity, vm.page_size) catch unreachable;
-        const pages = @as(u32, 1) << @truncate(std.math.log2_int_ceil(u32, pages_num));
+    for (&result, 0..) |*entry, i| {
+        const size = @max(i, 1) * min_size;
+        while (size_classes[class] < size) class += 1;
 
-        result[i] = vm.ObjectAllocator.initSized(size, pages);
+        entry.* = class;
     }
 
     return result;
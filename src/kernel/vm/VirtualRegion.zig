@@ -3,15 +3,27 @@
 //! This is growable memory region that is lineary mapped into
 //! virtual memory. But may consist of different physical regions.
 //! 
-//! The size and base address is aligned to `vm.page_size`
+//! The size and base address is aligned to `vm.page_size`,
+//! the region is placed in the kernel heap (see `vm.heapReserve`)
+//! and mapped with `vm.heapMap`.
+//! 
+//! A lazy region (see `makeLazy`) reserves only the virtual space,
+//! physical pages are allocated and mapped by the page fault handler
+//! on the first touch, see `handleFault`. Interrupt handlers must not touch
+//! not yet mapped pages of a lazy region: the fault allocates memory
+//! and changes the page tables.
+//! 
+//! Physical chunks are indexed by their end page index in a red-black tree,
+//! so an offset is translated in O(log n).
 
 const std = @import("std");
 
 const utils = @import("../utils.zig");
 const vm = @import("../vm.zig");
 
-const PageList = utils.SList(Page);
-const PageNode = PageList.Node;
+const PageTree = utils.RbTree(Page, Page.cmpEnd);
+const PageNode = PageTree.Node;
+const RegionTree = utils.RbTree(usize, cmpBase);
 
 const Page = packed struct {
     base: u32,
@@ -26,20 +38,69 @@ const Page = packed struct {
         return @as(u32, 1) << @truncate(self.rank);
     }
 
+    /// Index of the first page of the chunk, `idx` is the index following the last one.
+    pub inline fn beginIdx(self: *const Page) u32 {
+        return self.idx - self.pagesNum();
+    }
+
+    fn cmpEnd(lhs: *const Page, rhs: *const Page) utils.CmpResult {
+        if (lhs.idx == rhs.idx) return .equals;
+        return if (lhs.idx < rhs.idx) .less else .great;
+    }
+
     comptime {
-        std.debug.assert(@sizeOf(Page) == 16);
+        std.debug.assert(@sizeOf(Page) == @sizeOf(u64));
     }
 };
 
 const Self = @This();
 
+/// Maximum number of blocks allocated at once by `growBatch`.
+const grow_batch_max = 32;
+
 var page_oma = vm.SafeOma(PageNode).init(128);
 
+/// Lazy regions by the base address.
+var lazy_regions = RegionTree{};
+/// Protects only the tree, the faults of each region are serialized by its own `lock`.
+var lazy_lock = utils.Spinlock.init(.unlocked);
+
+/// Resident set statistics of the region.
+pub const Stats = struct {
+    /// Number of the virtual pages reserved by the region.
+    reserved_pages: u32,
+    /// Number of the pages backed by the physical memory.
+    resident_pages: u32,
+    /// Number of the page faults handled for the lazy region.
+    faults: u32,
+};
+
 /// Virtual base address
 base: usize,
 
-/// Physical pages list
-page_list: PageList = .{},
+/// Physical pages by the end index
+pages: PageTree = .{},
+/// Number of the pages added by `grow`.
+grown_pages: u32 = 0,
+
+/// Flags of the last mapped pages, lazy regions map the faulting pages with them.
+map_flags: vm.MapFlags = .{},
+
+/// Serializes changes of the chunks of the lazy region by the page faults.
+lock: utils.Spinlock = utils.Spinlock.init(.unlocked),
+/// The owner reference plus one per page fault in progress,
+/// taken under `lazy_lock` so `deinit` can wait for the faults to leave.
+fault_refs: utils.RefCount(u32) = .{},
+
+/// Node of the lazy regions tree, registered by `makeLazy`.
+lazy_node: RegionTree.Node = RegionTree.Node.init(0),
+/// Number of the reserved pages if the region is lazy, `0` otherwise.
+lazy_pages: u32 = 0,
+/// Rank of the blocks mapped on a page fault around the faulting page.
+fault_around_rank: u8 = 0,
+
+resident_pages: u32 = 0,
+faults: u32 = 0,
 
 pub fn init(virt: usize) Self {
     // Check alignment
@@ -48,38 +109,149 @@ pub fn init(virt: usize) Self {
     return .{ .base = virt };
 }
 
+/// Unmaps the region and frees its physical pages.
+/// The TLB entries are invalidated before the pages are freed,
+/// so they aren't reachable through the stale translations.
+/// The pages of a lazy region must not be accessed during the call.
 pub fn deinit(self: *Self) void {
-    var node = self.page_list.first;
+    if (self.isLazy()) {
+        lazy_lock.lock();
+        defer lazy_lock.unlock();
+
+        lazy_regions.removeNode(&self.lazy_node);
+    }
 
-    while (node) |n| {
-        node = n.next;
-        freePages(n);
+    // Faults that found the region before it was unlinked
+    while (self.fault_refs.count() > 1) std.atomic.spinLoopHint();
+
+    // Large pages are covered entirely, nothing to split
+    if (self.resident_pages > 0) vm.heapUnmap(self.base, self.getStats().reserved_pages) catch unreachable;
+
+    while (self.pages.findMin()) |node| {
+        self.pages.removeNode(node);
+        freePages(node);
     }
 }
 
 pub fn grow(self: *Self, rank: u8, map_flags: vm.MapFlags) bool {
-    const node = allocPages(rank) orelse return false;
-    const pages = @as(u32, 1) << @truncate(rank);
+    std.debug.assert(!self.isLazy());
 
-    vm.mmap(
-        self.base + self.size(),
-        node.data.getPhysBase(),
-        pages,
-        map_flags,
-        vm.getPt(),
-    ) catch {
-        freePages(node);
-        return false;
+    const phys = vm.PageAllocator.alloc(rank) orelse return false;
+    if (self.appendBlock(phys, rank, map_flags)) return true;
+
+    vm.PageAllocator.free(phys, rank);
+    return false;
+}
+
+/// Grows the region by `count` blocks of `2^rank` pages.
+/// The blocks are allocated in batches of up to `grow_batch_max`
+/// with `PageAllocator.allocBatch`, so the node lock is taken once per batch.
+/// 
+/// - Returns: The number of added blocks, less than `count` if there is not enough memory.
+pub fn growBatch(self: *Self, rank: u8, count: u32, map_flags: vm.MapFlags) u32 {
+    std.debug.assert(!self.isLazy());
+
+    var blocks: [grow_batch_max]usize = undefined;
+    var grown: u32 = 0;
+
+    while (grown < count) {
+        const batch = blocks[0..@min(count - grown, grow_batch_max)];
+        const allocated = vm.PageAllocator.allocBatch(rank, .unmovable, batch);
+
+        for (batch[0..allocated], 0..) |phys, i| {
+            if (!self.appendBlock(phys, rank, map_flags)) {
+                vm.PageAllocator.freeBatch(batch[i..allocated], rank);
+                return grown;
+            }
+
+            grown += 1;
+        }
+
+        if (allocated < batch.len) break;
+    }
+
+    return grown;
+}
+
+/// Turns the empty region into the lazy one: only `pages` of the virtual space
+/// are reserved, the physical pages are mapped on the first touch.
+/// The region must not be moved in memory after this call.
+/// 
+/// - `pages`: number of the pages to reserve.
+/// - `map_flags`: mapping flags of the pages.
+/// - `fault_around_rank`: each fault maps a block of `2^rank` pages around
+///   the faulting page if it isn't mapped partially, `0` to map a single page.
+pub fn makeLazy(self: *Self, pages: u32, map_flags: vm.MapFlags, fault_around_rank: u8) void {
+    std.debug.assert(self.lazy_pages == 0 and self.pages.root == null and pages > 0);
+
+    self.lazy_pages = pages;
+    self.map_flags = map_flags;
+    self.fault_around_rank = fault_around_rank;
+    self.lazy_node = RegionTree.Node.init(self.base);
+
+    lazy_lock.lock();
+    defer lazy_lock.unlock();
+
+    lazy_regions.insert(&self.lazy_node);
+}
+
+/// Maps the page of a lazy region on the page fault.
+/// Called by the architecture page fault handler for not present pages.
+/// Only the region lookup is done under `lazy_lock`, so faults
+/// of different regions are handled in parallel. The region is pinned
+/// by `fault_refs` until the fault is handled.
+/// 
+/// - `virt`: faulting virtual address.
+/// - Returns: `true` if the page was mapped and the access can be restarted.
+pub fn handleFault(virt: usize) bool {
+    const self: *Self = blk: {
+        lazy_lock.lock();
+        defer lazy_lock.unlock();
+
+        const node = lazy_regions.findFloor(virt) orelse return false;
+        const region: *Self = @fieldParentPtr("lazy_node", node);
+
+        region.fault_refs.inc();
+        break :blk region;
     };
+    defer self.fault_refs.dec();
 
-    node.data.idx = pages + if (self.page_list.first) |n| n.data.idx else 0;
-    self.page_list.prepend(node);
+    const page_idx = (virt - self.base) / vm.page_size;
+    if (page_idx >= self.lazy_pages) return false;
 
-    return true;
+    return self.fillPages(@truncate(page_idx));
 }
 
-pub inline fn shrink(self: *Self) ?u8 {
-    freePages(self.page_list.popFirst());
+pub inline fn isLazy(self: *const Self) bool {
+    return self.lazy_pages > 0;
+}
+
+pub fn getStats(self: *const Self) Stats {
+    return .{
+        .reserved_pages = if (self.isLazy()) self.lazy_pages else self.pagesNum(),
+        .resident_pages = self.resident_pages,
+        .faults = self.faults,
+    };
+}
+
+/// Unmaps and frees the last physical chunk of the region.
+/// 
+/// - Returns: The rank of the chunk or `null` if the region is empty.
+pub fn shrink(self: *Self) ?u8 {
+    std.debug.assert(!self.isLazy());
+
+    const node = self.pages.findMax() orelse return null;
+    const rank = node.data.rank;
+
+    const virt = self.base + (@as(usize, node.data.beginIdx()) * vm.page_size);
+    vm.heapUnmap(virt, node.data.pagesNum()) catch unreachable;
+
+    self.pages.removeNode(node);
+    self.grown_pages -= node.data.pagesNum();
+    self.resident_pages -= node.data.pagesNum();
+    freePages(node);
+
+    return rank;
 }
 
 pub inline fn size(self: *const Self) usize {
@@ -87,27 +259,23 @@ pub inline fn size(self: *const Self) usize {
 }
 
 pub inline fn pagesNum(self: *const Self) u32 {
-    return if (self.page_list.first) |n| n.data.idx else 0;
+    return self.grown_pages;
 }
 
+/// Returns the physical chunk containing the page.
 pub fn getPage(self: *const Self, idx: u32) ?*Page {
-    var node = self.page_list.first;
-
-    while (node) |n| : (node = n.next) {
-        const begin = n.data.idx;
-        const end = begin + n.data.pagesNum();
-
-        if (begin == idx or idx < end) return &n.data;
-    }
+    // The first chunk ending after the page
+    const key = Page{ .base = 0, .idx = @truncate(idx + 1) };
+    const node = self.pages.findCeil(key) orelse return null;
 
-    return null;
+    return if (node.data.beginIdx() <= idx) &node.data else null;
 }
 
 pub fn getPhys(self: *const Self, offset: usize) ?usize {
     const page_idx: u32 = @truncate(offset / vm.page_size);
-    const page = self.getPage(offset / vm.page_size) orelse return null;
+    const page = self.getPage(page_idx) orelse return null;
 
-    const page_base = page.getPhysBase() + ((page_idx - page.idx) * vm.page_size);
+    const page_base = page.getPhysBase() + (@as(usize, page_idx - page.beginIdx()) * vm.page_size);
 
     return page_base + (offset % vm.page_size); 
 }
@@ -116,6 +284,118 @@ pub inline fn getVirtLma(self: *const Self, offset: usize) ?usize {
     return vm.getVirtLma(self.getPhys(offset) orelse return null);
 }
 
+/// Allocates, zeroes and maps the pages of the lazy region at the faulting page.
+/// The block is allocated and zeroed without the lock, then claimed
+/// in the chunks tree under `lock` and mapped. If a concurrent fault has claimed
+/// a part of the block meanwhile, the block is freed and the access restarted.
+fn fillPages(self: *Self, page_idx: u32) bool {
+    const block = blk: {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        // The fault may be already handled by another CPU
+        if (self.getPage(page_idx) != null) return true;
+
+        break :blk self.getFaultBlock(page_idx);
+    };
+
+    const node = allocPages(block.rank) orelse return false;
+    const pages = node.data.pagesNum();
+    const virt = self.base + (@as(usize, block.begin) * vm.page_size);
+
+    @memset(@as([*]u8, @ptrFromInt(vm.getVirtLma(node.data.getPhysBase())))[0..pages * vm.page_size], 0);
+
+    node.data.idx = @truncate(block.begin + pages);
+
+    const is_claimed = blk: {
+        self.lock.lock();
+        defer self.lock.unlock();
+
+        if (self.hasPages(block.begin, pages)) break :blk false;
+
+        self.pages.insert(node);
+        self.resident_pages += pages;
+        self.faults += 1;
+
+        break :blk true;
+    };
+
+    if (!is_claimed) {
+        freePages(node);
+        return true;
+    }
+
+    vm.heapMap(virt, node.data.getPhysBase(), pages, self.map_flags) catch {
+        {
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            self.pages.removeNode(node);
+            self.resident_pages -= pages;
+            self.faults -= 1;
+        }
+
+        freePages(node);
+        return false;
+    };
+
+    return true;
+}
+
+/// Returns the block to map around the faulting page: the aligned block of
+/// `2^fault_around_rank` pages, or a smaller one if it crosses the region end
+/// or overlaps mapped pages. Must be called with `lock` held.
+fn getFaultBlock(self: *const Self, page_idx: u32) struct { rank: u8, begin: u32 } {
+    var rank = self.fault_around_rank;
+    var begin = page_idx;
+
+    while (true) : (rank -= 1) {
+        const block_pages = @as(u32, 1) << @truncate(rank);
+        begin = page_idx & ~(block_pages - 1);
+
+        if (rank == 0 or (begin + block_pages <= self.lazy_pages and !self.hasPages(begin, block_pages))) break;
+    }
+
+    return .{ .rank = rank, .begin = begin };
+}
+
+/// Checks if any page of the range is mapped.
+fn hasPages(self: *const Self, begin: u32, pages: u32) bool {
+    const key = Page{ .base = 0, .idx = @truncate(begin + 1) };
+    const node = self.pages.findCeil(key) orelse return false;
+
+    return node.data.beginIdx() < begin + pages;
+}
+
+/// Maps the physical block at the end of the region and adds it to the chunks.
+fn appendBlock(self: *Self, phys: usize, rank: u8, map_flags: vm.MapFlags) bool {
+    const node = page_oma.alloc() orelse return false;
+    const pages = @as(u32, 1) << @truncate(rank);
+
+    vm.heapMap(self.base + self.size(), phys, pages, map_flags) catch {
+        page_oma.free(node);
+        return false;
+    };
+
+    node.data = .{
+        .rank = rank,
+        .base = @truncate(phys / vm.page_size),
+        .idx = @truncate(self.grown_pages + pages),
+    };
+
+    self.pages.insert(node);
+    self.grown_pages += pages;
+    self.map_flags = map_flags;
+    self.resident_pages += pages;
+
+    return true;
+}
+
+fn cmpBase(lhs: *const usize, rhs: *const usize) utils.CmpResult {
+    if (lhs.* == rhs.*) return .equals;
+    return if (lhs.* < rhs.*) .less else .great;
+}
+
 fn allocPages(rank: u8) ?*PageNode {
     const node = page_oma.alloc() orelse return null;
     const phys = vm.PageAllocator.alloc(rank) orelse {
@@ -123,9 +403,9 @@ fn allocPages(rank: u8) ?*PageNode {
         return null;
     };
 
-    node.data.* = .{
+    node.data = .{
         .rank = rank,
-        .base = phys / vm.page_size
+        .base = @truncate(phys / vm.page_size)
     };
 
     return node;
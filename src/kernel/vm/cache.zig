@@ -208,7 +208,7 @@ const HashTable = struct {
         const page_node = page_oma.alloc() orelse return error.NoMemory;
         errdefer page_oma.free(page_node);
 
-        const phys = vm.PageAllocator.alloc(rank) orelse return error.NoMemory;
+        const phys = vm.PageAllocator.allocEx(rank, .reclaimable) orelse return error.NoMemory;
     
         page_node.data.base = @truncate(phys / vm.page_size);
         page_node.data.rank = rank;
@@ -304,7 +304,7 @@ pub const ControlBlock = struct {
         const node = self.node_oma.alloc() orelse return null;
         const entry = &node.data;
 
-        const phys = vm.PageAllocator.alloc(block_rank) orelse {
+        const phys = vm.PageAllocator.allocEx(block_rank, .movable) orelse {
             self.node_oma.free(node);
             return null;
         };
@@ -322,6 +322,30 @@ pub const ControlBlock = struct {
     //    vm.PageAllocator.free(node.data.data.getPhysBase(), block_rank);
     //}
 
+    /// Migrates unused blocks placed in the pages range `[begin, end)`.
+    /// Blocks in use are pinned and stay in place.
+    fn evacuate(self: *ControlBlock, begin: u32, end: u32) u32 {
+        self.lru_lock.lock();
+        defer self.lru_lock.unlock();
+
+        var moved: u32 = 0;
+        var node = self.lru_list.first;
+
+        while (node) |lru| : (node = lru.next) {
+            const block = &lru.data.data;
+            const page: u32 = @truncate(block.getPhysBase() / vm.page_size);
+
+            if (page < begin or page >= end) continue;
+
+            const phys = vm.PageAllocator.migrate(block.getPhysBase(), block_rank) orelse break;
+            block.phys_base = @truncate(phys / block_size);
+
+            moved += 1;
+        }
+
+        return moved;
+    }
+
     inline fn track(self: *ControlBlock, block: *Block) void {
         const node = getLruNode(block);
         self.lru_list.prepend(node);
@@ -352,6 +376,15 @@ var ctrl_lock = utils.Spinlock.init(.unlocked);
 var ctrl_list: CtrlList = .{};
 var ctrl_oma = CtrlOma.init(32);
 
+var mover = vm.PageAllocator.Mover{ .data = evacuateBlocks };
+
+/// Registers the cache blocks mover for the physical memory compaction.
+/// The compaction calls the mover with `movers_lock` held and the mover takes `ctrl_lock`,
+/// so the mover is registered once here and not under `ctrl_lock`.
+pub fn init() void {
+    vm.PageAllocator.registerMover(&mover);
+}
+
 pub fn newCtrl() Error!*ControlBlock {
     const node = ctrl_oma.alloc() orelse return error.NoMemory;
     errdefer ctrl_oma.free(node);
@@ -401,6 +434,21 @@ pub fn swap(target_num: u32) u32 {
     return num;
 }
 
+/// Cache blocks mover for the physical memory compaction.
+fn evacuateBlocks(_: *vm.PageAllocator.Mover, begin: u32, end: u32) u32 {
+    ctrl_lock.lock();
+    defer ctrl_lock.unlock();
+
+    var moved: u32 = 0;
+    var node = ctrl_list.first;
+
+    while (node) |ctrl| : (node = ctrl.next) {
+        moved += ctrl.data.evacuate(begin, end);
+    }
+
+    return moved;
+}
+
 pub inline fn offsetToBlock(offset: usize) u32 {
     return @truncate(offset / block_size);
 }
@@ -0,0 +1,332 @@
+//! # Thread-safe object allocator
+//!
+//! `SafeOma` combines the `vm.ObjectAllocator` and `Spinlock` with a magazine layer
+//! in front of them. Each CPU keeps two magazines (stacks of free objects):
+//! `loaded` and `previous`. Most allocations and frees are served from them
+//! without taking the lock.
+//!
+//! When both magazines are exhausted, they are exchanged in bulk with a shared
+//! depot of full and empty magazines. Only if the depot can't help,
+//! the object is allocated from (or freed to) the object allocator itself.
+//!
+//! The `previous` magazine is always either full or empty, so a CPU
+//! alternating allocations and frees never goes to the depot.
+//!
+//! The depot keeps up to `depot_max_full` full magazines, the excess objects
+//! are returned to the object allocator, so cached objects don't pin
+//! it's arenas. `trim` flushes the whole depot.
+//!
+//! Objects are freed from interrupt handlers too, so the magazines and
+//! the lock are used with interrupts disabled on the current CPU.
+
+// Copyright (C) 2024 Konstantin Pigulevskiy (bagggage@github)
+
+const std = @import("std");
+
+const intr = @import("../dev/intr.zig");
+const smp = @import("../smp.zig");
+const utils = @import("../utils.zig");
+const vm = @import("../vm.zig");
+
+const Spinlock = utils.Spinlock;
+
+/// Number of the objects in a magazine.
+pub const magazine_size = 15;
+/// Maximum number of the full magazines kept in the depot.
+pub const depot_max_full = 4;
+/// Maximum number of CPUs with own magazines,
+/// the rest of CPUs always use the locked path.
+pub const max_cpus = 64;
+
+/// Stack of free objects.
+const Magazine = struct {
+    rounds: u32 = 0,
+    objs: [magazine_size]*anyopaque = undefined,
+
+    inline fn isFull(self: *const Magazine) bool {
+        return self.rounds == magazine_size;
+    }
+
+    inline fn isEmpty(self: *const Magazine) bool {
+        return self.rounds == 0;
+    }
+
+    inline fn push(self: *Magazine, obj: *anyopaque) void {
+        self.objs[self.rounds] = obj;
+        self.rounds += 1;
+    }
+
+    inline fn pop(self: *Magazine) *anyopaque {
+        self.rounds -= 1;
+        return self.objs[self.rounds];
+    }
+};
+
+const MagazineList = utils.SList(Magazine);
+const MagazineNode = MagazineList.Node;
+
+/// Magazine layer statistics.
+pub const Stats = struct {
+    /// Number of allocations and frees served by the per-CPU magazines.
+    hits: usize = 0,
+    /// Number of allocations and frees that took the lock.
+    misses: usize = 0,
+
+    /// Returns the percentage of the operations served by the per-CPU magazines.
+    pub fn getHitRate(self: Stats) u8 {
+        const total = self.hits + self.misses;
+        return if (total > 0) @truncate((self.hits * 100) / total) else 0;
+    }
+};
+
+/// Magazines of a CPU.
+/// Accessed only by the owning CPU with interrupts disabled.
+const CpuMagazines = struct {
+    loaded: ?*MagazineNode = null,
+    previous: ?*MagazineNode = null,
+
+    stats: Stats = .{},
+};
+
+/// Allocator of the magazines shared by all instances.
+var magazine_oma = vm.ObjectAllocator.init(MagazineNode);
+var magazine_lock = Spinlock.init(.unlocked);
+
+/// Thread-safe Object memory allocator wrapper.
+/// Combination of the `ObjectAllocator`, `Spinlock` and per-CPU magazines.
+pub fn SafeOma(comptime T: type) type {
+    return struct {
+        const Self = @This();
+
+        oma: vm.ObjectAllocator = vm.ObjectAllocator.init(T),
+        lock: Spinlock = Spinlock.init(.unlocked),
+
+        /// Depot of the full magazines.
+        full: MagazineList = .{},
+        full_num: u32 = 0,
+        /// Depot of the empty magazines.
+        empty: MagazineList = .{},
+
+        cpus: [max_cpus]CpuMagazines = .{CpuMagazines{}} ** max_cpus,
+
+        pub fn alloc(self: *Self) ?*T {
+            const cpu_idx = smp.getIdx();
+            if (cpu_idx >= max_cpus) return self.allocLocked();
+
+            const intr_state = intr.saveAndDisableForCpu();
+            defer intr.restoreForCpu(intr_state);
+
+            const cpu = &self.cpus[cpu_idx];
+
+            if (cpu.loaded) |loaded| {
+                if (!loaded.data.isEmpty()) {
+                    cpu.stats.hits += 1;
+                    return @alignCast(@ptrCast(loaded.data.pop()));
+                }
+            }
+            if (cpu.previous) |previous| {
+                if (!previous.data.isEmpty()) {
+                    cpu.previous = cpu.loaded;
+                    cpu.loaded = previous;
+
+                    cpu.stats.hits += 1;
+                    return @alignCast(@ptrCast(previous.data.pop()));
+                }
+            }
+
+            cpu.stats.misses += 1;
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            // Exchange the empty magazine for a full one
+            const full = self.full.popFirst() orelse return self.oma.alloc(T);
+            self.full_num -= 1;
+
+            if (cpu.previous) |previous| self.empty.prepend(previous);
+            cpu.previous = cpu.loaded;
+            cpu.loaded = full;
+
+            return @alignCast(@ptrCast(full.data.pop()));
+        }
+
+        pub fn free(self: *Self, obj_ptr: *anyopaque) void {
+            const cpu_idx = smp.getIdx();
+            if (cpu_idx >= max_cpus) return self.freeLocked(obj_ptr);
+
+            const intr_state = intr.saveAndDisableForCpu();
+            defer intr.restoreForCpu(intr_state);
+
+            const cpu = &self.cpus[cpu_idx];
+
+            if (cpu.loaded) |loaded| {
+                if (!loaded.data.isFull()) {
+                    cpu.stats.hits += 1;
+                    return loaded.data.push(obj_ptr);
+                }
+            }
+            if (cpu.previous) |previous| {
+                if (previous.data.isEmpty()) {
+                    cpu.previous = cpu.loaded;
+                    cpu.loaded = previous;
+
+                    cpu.stats.hits += 1;
+                    return previous.data.push(obj_ptr);
+                }
+            }
+
+            cpu.stats.misses += 1;
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            // Exchange the full magazine for an empty one
+            const empty = self.empty.popFirst() orelse allocMagazine() orelse {
+                return self.oma.free(obj_ptr);
+            };
+
+            if (cpu.previous) |previous| self.putFull(previous);
+            cpu.previous = cpu.loaded;
+            cpu.loaded = empty;
+
+            empty.data.push(obj_ptr);
+        }
+
+        pub inline fn init(comptime capacity: usize) Self {
+            return .{
+                .oma = vm.ObjectAllocator.initCapacity(@sizeOf(T), capacity)
+            };
+        }
+
+        /// Initializes the allocator with the objects placement options,
+        /// see `vm.ObjectAllocator.Options`.
+        pub inline fn initEx(comptime capacity: usize, comptime options: vm.ObjectAllocator.Options) Self {
+            return .{
+                .oma = vm.ObjectAllocator.initCapacityEx(@sizeOf(T), capacity, options)
+            };
+        }
+
+        /// Frees all magazines and memory of the allocator.
+        /// Objects cached in the magazines are freed along with the arenas.
+        pub fn deinit(self: *Self) void {
+            for (&self.cpus) |*cpu| {
+                if (cpu.loaded) |loaded| freeMagazine(loaded);
+                if (cpu.previous) |previous| freeMagazine(previous);
+
+                cpu.* = .{};
+            }
+
+            while (self.full.popFirst()) |magazine| freeMagazine(magazine);
+            while (self.empty.popFirst()) |magazine| freeMagazine(magazine);
+
+            self.full_num = 0;
+            self.oma.deinit();
+        }
+
+        /// Returns the objects of the depot and the current CPU magazines
+        /// to the object allocator and frees the depot magazines,
+        /// so the empty arenas can be released.
+        /// Magazines of other CPUs are kept.
+        pub fn trim(self: *Self) void {
+            const intr_state = intr.saveAndDisableForCpu();
+            defer intr.restoreForCpu(intr_state);
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            const cpu_idx = smp.getIdx();
+
+            if (cpu_idx < max_cpus) {
+                const cpu = &self.cpus[cpu_idx];
+
+                if (cpu.loaded) |loaded| self.flushMagazine(loaded);
+                if (cpu.previous) |previous| self.flushMagazine(previous);
+            }
+
+            while (self.full.popFirst()) |magazine| {
+                self.flushMagazine(magazine);
+                freeMagazine(magazine);
+            }
+            while (self.empty.popFirst()) |magazine| freeMagazine(magazine);
+
+            self.full_num = 0;
+        }
+
+        /// Collects the magazine layer statistics over all CPUs.
+        pub fn getStats(self: *const Self) Stats {
+            var stats = Stats{};
+
+            for (&self.cpus) |*cpu| {
+                stats.hits += cpu.stats.hits;
+                stats.misses += cpu.stats.misses;
+            }
+
+            return stats;
+        }
+
+        /// Puts the full magazine into the depot.
+        /// If the depot is full, the objects are returned to the object allocator instead
+        /// and the magazine goes to the empty ones.
+        /// Must be called with `lock` held.
+        fn putFull(self: *Self, magazine: *MagazineNode) void {
+            if (self.full_num < depot_max_full) {
+                self.full.prepend(magazine);
+                self.full_num += 1;
+            } else {
+                self.flushMagazine(magazine);
+                self.empty.prepend(magazine);
+            }
+        }
+
+        /// Returns all objects of the magazine to the object allocator.
+        /// Must be called with `lock` held.
+        fn flushMagazine(self: *Self, magazine: *MagazineNode) void {
+            while (!magazine.data.isEmpty()) self.oma.free(magazine.data.pop());
+        }
+
+        fn allocLocked(self: *Self) ?*T {
+            const intr_state = intr.saveAndDisableForCpu();
+            defer intr.restoreForCpu(intr_state);
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            return self.oma.alloc(T);
+        }
+
+        fn freeLocked(self: *Self, obj_ptr: *anyopaque) void {
+            const intr_state = intr.saveAndDisableForCpu();
+            defer intr.restoreForCpu(intr_state);
+
+            self.lock.lock();
+            defer self.lock.unlock();
+
+            self.oma.free(obj_ptr);
+        }
+    };
+}
+
+/// Takes `magazine_lock` with interrupts disabled, magazines are allocated
+/// from `free` in interrupt handlers too.
+fn allocMagazine() ?*MagazineNode {
+    const intr_state = intr.saveAndDisableForCpu();
+    defer intr.restoreForCpu(intr_state);
+
+    magazine_lock.lock();
+    defer magazine_lock.unlock();
+
+    const magazine = magazine_oma.alloc(MagazineNode) orelse return null;
+    magazine.* = .{ .data = .{} };
+
+    return magazine;
+}
+
+fn freeMagazine(magazine: *MagazineNode) void {
+    const intr_state = intr.saveAndDisableForCpu();
+    defer intr.restoreForCpu(intr_state);
+
+    magazine_lock.lock();
+    defer magazine_lock.unlock();
+
+    magazine_oma.free(magazine);
+}